@@ -1,6 +1,7 @@
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
+#include <sys/time.h>
 #include "config.h"
 #include "paxos.h"
 #include "handle.h"
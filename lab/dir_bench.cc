@@ -0,0 +1,208 @@
+//
+// directory format benchmark
+//
+// times lookups, inserts and removes in directories of 10, 10k and 1M
+// entries, for the text format yfs_client used to keep ("name;inum\n" per
+// entry, parsed into a std::map on every call) and for dir_format, and
+// prints the bytes each operation reads and writes. the directory lives in
+// memory, so only the cost of the formats themselves is measured.
+//
+
+#include "dir_format.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <map>
+#include <sstream>
+
+// a directory extent in memory, counting the bytes that move
+class memory_dir_io : public dir_io {
+public:
+    std::string data;
+    unsigned long long bytesRead;
+    unsigned long long bytesWritten;
+
+    memory_dir_io() : bytesRead(0), bytesWritten(0) {}
+
+    bool read(unsigned long long off, unsigned int len, std::string &buf) {
+        buf = off < data.size() ? data.substr(off, len) : std::string();
+        bytesRead += buf.size();
+        return true;
+    }
+
+    bool write(unsigned long long off, const std::string &d) {
+        if (data.size() < off + d.size()) {
+            data.resize(off + d.size());
+        }
+        data.replace(off, d.size(), d);
+        bytesWritten += d.size();
+        return true;
+    }
+
+    bool put(const std::string &d) {
+        data = d;
+        bytesWritten += d.size();
+        return true;
+    }
+};
+
+// the old text format, as yfs_client had it
+static std::vector<std::string>
+split(std::string s, std::string delimiter) {
+    size_t pos = 0;
+    std::vector<std::string> output;
+
+    while ((pos = s.find(delimiter)) != std::string::npos) {
+        output.push_back(s.substr(0, pos));
+        s.erase(0, pos + delimiter.length());
+    }
+    output.push_back(s);
+    return output;
+}
+
+static std::string
+serialize(const std::map<std::string, unsigned long long> &directory) {
+    std::string result;
+    for (auto const &it : directory) {
+        std::ostringstream ost;
+        ost << it.second;
+        result += it.first + ";" + ost.str() + "\n";
+    }
+    return result;
+}
+
+static std::map<std::string, unsigned long long>
+unserialize(const std::string &s) {
+    std::map<std::string, unsigned long long> directory;
+    for (const std::string &row : split(s, "\n")) {
+        if (!row.empty()) {
+            std::vector<std::string> entry = split(row, ";");
+            directory[entry.at(0)] = strtoull(entry.at(1).c_str(), NULL, 10);
+        }
+    }
+    return directory;
+}
+
+static double
+now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static std::string
+name(size_t i) {
+    char buf[32];
+    sprintf(buf, "file-%zu.txt", i);
+    return buf;
+}
+
+static void
+report(const char *format, size_t n, const char *op, double secs, size_t ops, unsigned long long bytes) {
+    printf("%-4s %8zu entries  %-7s %12.1f us/op %12llu bytes/op\n", format, n, op, secs * 1e6 / ops, bytes / ops);
+}
+
+static void
+bench_text(size_t n, size_t ops) {
+    std::map<std::string, unsigned long long> initial;
+    for (size_t i = 0; i < n; i++) {
+        initial[name(i)] = i + 2;
+    }
+    std::string stored = serialize(initial);
+    initial.clear();
+    unsigned int seed = n;
+    unsigned long long bytes = 0;
+
+    double t = now();
+    for (size_t i = 0; i < ops; i++) {
+        auto d = unserialize(stored);
+        assert(d.find(name(rand_r(&seed) % n)) != d.end());
+        bytes += stored.size();
+    }
+    report("text", n, "lookup", now() - t, ops, bytes);
+
+    // every insert is undone by a remove, so the directory keeps its size
+    double inserting = 0, removing = 0;
+    unsigned long long insertBytes = 0, removeBytes = 0;
+    for (size_t i = 0; i < ops; i++) {
+        t = now();
+        auto d = unserialize(stored);
+        d[name(n + i)] = n + i + 2;
+        insertBytes += stored.size();
+        stored = serialize(d);
+        insertBytes += stored.size();
+        inserting += now() - t;
+
+        t = now();
+        d = unserialize(stored);
+        d.erase(name(n + i));
+        removeBytes += stored.size();
+        stored = serialize(d);
+        removeBytes += stored.size();
+        removing += now() - t;
+    }
+    report("text", n, "insert", inserting, ops, insertBytes);
+    report("text", n, "remove", removing, ops, removeBytes);
+}
+
+static void
+bench_hashed(size_t n, size_t ops) {
+    memory_dir_io io;
+    std::vector<dir_entry> initial;
+    for (size_t i = 0; i < n; i++) {
+        dir_entry e = {name(i), i + 2};
+        initial.push_back(e);
+    }
+    io.data = dir_format::build(initial);
+    initial.clear();
+    dir_format dir(io);
+    unsigned int seed = n;
+    unsigned long long inum;
+
+    double t = now();
+    for (size_t i = 0; i < ops; i++) {
+        size_t k = rand_r(&seed) % n;
+        assert(dir.lookup(name(k), inum) == dir_format::OK && inum == k + 2);
+    }
+    report("hash", n, "lookup", now() - t, ops, io.bytesRead);
+
+    double inserting = 0, removing = 0;
+    unsigned long long insertBytes = 0, removeBytes = 0;
+    for (size_t i = 0; i < ops; i++) {
+        io.bytesRead = io.bytesWritten = 0;
+        t = now();
+        assert(dir.add(name(n + i), n + i + 2) == dir_format::OK);
+        inserting += now() - t;
+        insertBytes += io.bytesRead + io.bytesWritten;
+
+        io.bytesRead = io.bytesWritten = 0;
+        t = now();
+        assert(dir.remove(name(n + i)) == dir_format::OK);
+        removing += now() - t;
+        removeBytes += io.bytesRead + io.bytesWritten;
+    }
+    report("hash", n, "insert", inserting, ops, insertBytes);
+    report("hash", n, "remove", removing, ops, removeBytes);
+
+    std::vector<dir_entry> entries;
+    assert(dir.list(entries) == dir_format::OK && entries.size() == n);
+}
+
+int
+main(int argc, char *argv[]) {
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    const size_t sizes[] = {10, 10000, 1000000};
+    for (size_t n : sizes) {
+        // parsing the text format is quadratic in the size of the directory;
+        // at 1M entries a single call takes hours
+        if (n <= 10000) {
+            bench_text(n, n <= 10 ? 1000 : 5);
+        } else {
+            printf("text %8zu entries  skipped\n", n);
+        }
+        bench_hashed(n, 10000);
+    }
+    return 0;
+}
@@ -0,0 +1,315 @@
+// hashed directory format
+
+#include "dir_format.h"
+#include <string.h>
+#include <climits>
+#include <algorithm>
+
+static const uint32_t DIR_MAGIC = 0x79667364;  // "yfsd"
+static const uint32_t MIN_BUCKETS = 16;
+static const size_t list_chunk = 64 * 1024;
+
+dir_format::dir_format(dir_io &io) : io(io) {
+}
+
+// FNV-1a
+uint32_t
+dir_format::hash(const std::string &name) {
+    uint32_t h = 2166136261u;
+    for (unsigned char c : name) {
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+uint32_t
+dir_format::bucketOffset(uint32_t b) {
+    return sizeof(header) + b * sizeof(uint32_t);
+}
+
+dir_format::status
+dir_format::readHeader(header &h, bool &empty) {
+    std::string buf;
+    if (!io.read(0, sizeof(h), buf)) {
+        return IOERR;
+    }
+    empty = buf.empty();
+    if (empty) {
+        return OK;
+    }
+    if (buf.size() < sizeof(h)) {
+        return IOERR;
+    }
+    memcpy(&h, buf.data(), sizeof(h));
+    if (h.magic != DIR_MAGIC || h.nbuckets == 0) {
+        return IOERR;
+    }
+    return OK;
+}
+
+// walk the chain of the bucket name hashes to
+dir_format::status
+dir_format::find(const header &h, const std::string &name, position &pos) {
+    uint32_t hv = hash(name);
+    std::string buf;
+
+    pos.link = bucketOffset(hv % h.nbuckets);
+    if (!io.read(pos.link, sizeof(uint32_t), buf) || buf.size() < sizeof(uint32_t)) {
+        return IOERR;
+    }
+    memcpy(&pos.off, buf.data(), sizeof(uint32_t));
+
+    while (pos.off != 0) {
+        if (!io.read(pos.off, sizeof(entry_header) + max_name, buf) || buf.size() < sizeof(entry_header)) {
+            return IOERR;
+        }
+        memcpy(&pos.e, buf.data(), sizeof(entry_header));
+        if (buf.size() < sizeof(entry_header) + pos.e.namelen) {
+            return IOERR;
+        }
+        if (pos.e.hash == hv && name.compare(0, std::string::npos, buf, sizeof(entry_header), pos.e.namelen) == 0) {
+            return OK;
+        }
+        pos.link = pos.off;
+        pos.off = pos.e.next;
+    }
+    return NOENT;
+}
+
+dir_format::status
+dir_format::lookup(const std::string &name, unsigned long long &inum) {
+    header h;
+    bool empty;
+    status ret = readHeader(h, empty);
+    if (ret != OK) {
+        return ret;
+    }
+    if (empty) {
+        return NOENT;
+    }
+
+    position pos;
+    if ((ret = find(h, name, pos)) == OK) {
+        inum = pos.e.inum;
+    }
+    return ret;
+}
+
+dir_format::status
+dir_format::add(const std::string &name, unsigned long long inum) {
+    if (name.size() > max_name) {
+        return IOERR;
+    }
+
+    header h;
+    bool empty;
+    status ret = readHeader(h, empty);
+    if (ret != OK) {
+        return ret;
+    }
+
+    // the first entry, or more than two per bucket: start over with more
+    // buckets
+    if (empty || h.count + 1 > 2 * h.nbuckets) {
+        std::vector<dir_entry> entries;
+        if (!empty && (ret = list(entries)) != OK) {
+            return ret;
+        }
+        for (auto &e : entries) {
+            if (e.name == name) {
+                return EXIST;
+            }
+        }
+        dir_entry e = {name, inum};
+        entries.push_back(e);
+        return rebuild(empty ? NULL : &h, entries);
+    }
+
+    position pos;
+    if ((ret = find(h, name, pos)) != NOENT) {
+        return ret == OK ? EXIST : ret;
+    }
+
+    // find stopped at the end of the chain, so the new entry goes in front
+    uint32_t b = hash(name) % h.nbuckets;
+    std::string buf;
+    if (!io.read(bucketOffset(b), sizeof(uint32_t), buf) || buf.size() < sizeof(uint32_t)) {
+        return IOERR;
+    }
+
+    entry_header e;
+    memset(&e, 0, sizeof(e));
+    memcpy(&e.next, buf.data(), sizeof(uint32_t));
+    e.hash = hash(name);
+    e.inum = inum;
+    e.namelen = name.size();
+
+    uint32_t off = h.end;
+    std::string rec((const char *) &e, sizeof(e));
+    rec += name;
+    if (!io.write(off, rec) ||
+        !io.write(bucketOffset(b), std::string((const char *) &off, sizeof(off)))) {
+        return IOERR;
+    }
+
+    h.count++;
+    h.end += rec.size();
+    if (!io.write(0, std::string((const char *) &h, sizeof(h)))) {
+        return IOERR;
+    }
+    return OK;
+}
+
+dir_format::status
+dir_format::remove(const std::string &name) {
+    header h;
+    bool empty;
+    status ret = readHeader(h, empty);
+    if (ret != OK) {
+        return ret;
+    }
+    if (empty) {
+        return NOENT;
+    }
+
+    position pos;
+    if ((ret = find(h, name, pos)) != OK) {
+        return ret;
+    }
+
+    // more than half dead: write the live entries out afresh
+    uint32_t size = sizeof(entry_header) + pos.e.namelen;
+    if (h.dead + size > h.end / 2) {
+        std::vector<dir_entry> entries;
+        if ((ret = list(entries)) != OK) {
+            return ret;
+        }
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i].name == name) {
+                entries.erase(entries.begin() + i);
+                break;
+            }
+        }
+        return rebuild(&h, entries);
+    }
+
+    // the link is a bucket or the next field, which starts an entry
+    pos.e.flags |= DEAD;
+    if (!io.write(pos.link, std::string((const char *) &pos.e.next, sizeof(uint32_t))) ||
+        !io.write(pos.off, std::string((const char *) &pos.e, sizeof(entry_header)))) {
+        return IOERR;
+    }
+
+    h.count--;
+    h.dead += size;
+    if (!io.write(0, std::string((const char *) &h, sizeof(h)))) {
+        return IOERR;
+    }
+    return OK;
+}
+
+dir_format::status
+dir_format::list(std::vector<dir_entry> &entries) {
+    std::vector<unsigned long long> cursors;
+    return list(0, UINT_MAX, entries, cursors);
+}
+
+dir_format::status
+dir_format::list(unsigned long long cursor, unsigned int count, std::vector<dir_entry> &entries,
+                 std::vector<unsigned long long> &cursors) {
+    header h;
+    bool empty;
+    status ret = readHeader(h, empty);
+    if (ret != OK || empty) {
+        return ret;
+    }
+
+    uint32_t start = bucketOffset(h.nbuckets);
+    uint32_t pos = start;
+    if (cursor != 0) {
+        if ((uint32_t) (cursor >> 32) != h.generation) {
+            return STALE;
+        }
+        pos = (uint32_t) cursor;
+    }
+    if (pos < start || pos > h.end) {
+        return IOERR;
+    }
+
+    // read in chunks that hold at least one whole entry
+    std::string buf;
+    size_t p = 0;
+    unsigned int found = 0;
+    while (pos < h.end && found < count) {
+        entry_header e;
+        bool whole = p + sizeof(e) <= buf.size();
+        if (whole) {
+            memcpy(&e, buf.data() + p, sizeof(e));
+            whole = p + sizeof(e) + e.namelen <= buf.size();
+        }
+        if (!whole) {
+            unsigned int want = std::min((size_t) (h.end - pos), std::max(list_chunk, sizeof(e) + max_name));
+            if (!io.read(pos, want, buf) || buf.size() < sizeof(e)) {
+                return IOERR;
+            }
+            p = 0;
+            memcpy(&e, buf.data(), sizeof(e));
+            if (sizeof(e) + e.namelen > buf.size()) {
+                return IOERR;
+            }
+        }
+
+        p += sizeof(e) + e.namelen;
+        pos += sizeof(e) + e.namelen;
+        if (!(e.flags & DEAD)) {
+            dir_entry d = {buf.substr(p - e.namelen, e.namelen), e.inum};
+            entries.push_back(d);
+            cursors.push_back(((unsigned long long) h.generation << 32) | pos);
+            found++;
+        }
+    }
+    return OK;
+}
+
+std::string
+dir_format::build(const std::vector<dir_entry> &entries, uint32_t generation) {
+    header h;
+    memset(&h, 0, sizeof(h));
+    h.magic = DIR_MAGIC;
+    h.generation = generation;
+    h.nbuckets = MIN_BUCKETS;
+    while (h.nbuckets < entries.size()) {
+        h.nbuckets *= 2;
+    }
+    h.count = entries.size();
+
+    std::vector<uint32_t> buckets(h.nbuckets, 0);
+    std::string body;
+    uint32_t start = bucketOffset(h.nbuckets);
+
+    for (auto &d : entries) {
+        entry_header e;
+        memset(&e, 0, sizeof(e));
+        e.hash = hash(d.name);
+        e.inum = d.inum;
+        e.namelen = d.name.size();
+
+        uint32_t b = e.hash % h.nbuckets;
+        e.next = buckets[b];
+        buckets[b] = start + body.size();
+
+        body.append((const char *) &e, sizeof(e));
+        body += d.name;
+    }
+    h.end = start + body.size();
+
+    std::string image((const char *) &h, sizeof(h));
+    image.append((const char *) buckets.data(), buckets.size() * sizeof(uint32_t));
+    image += body;
+    return image;
+}
+
+dir_format::status
+dir_format::rebuild(const header *old, const std::vector<dir_entry> &entries) {
+    return io.put(build(entries, old != NULL ? old->generation + 1 : 0)) ? OK : IOERR;
+}
@@ -0,0 +1,116 @@
+// on-disk format of directories
+
+#ifndef dir_format_h
+#define dir_format_h
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// byte-range access to the extent that holds a directory
+class dir_io {
+public:
+    virtual ~dir_io() {}
+
+    // reads are clipped at the end of the extent
+    virtual bool read(unsigned long long off, unsigned int len, std::string &buf) = 0;
+
+    virtual bool write(unsigned long long off, const std::string &data) = 0;
+
+    // replaces the whole extent
+    virtual bool put(const std::string &data) = 0;
+};
+
+struct dir_entry {
+    std::string name;
+    unsigned long long inum;
+};
+
+// A directory is a header, an array of hash buckets and a run of entries:
+//
+//   header | bucket[0..nbuckets) | entry entry entry ...
+//
+// Each bucket holds the offset of the first entry whose name hashes to it,
+// and every entry links to the next one of its bucket. An entry is a fixed
+// header followed by the name. Lookups read the header, one bucket and the
+// entries of its chain; adding an entry appends it and rewrites one bucket
+// and the header; removing one unlinks it and marks it dead. The whole
+// directory is only rewritten when the buckets get too crowded or too much
+// of it is dead, which keeps every operation amortized O(1).
+//
+// Listings can be resumed from a cursor, the offset of the next entry
+// tagged with the generation of the layout. A rewrite bumps the generation,
+// and resuming from a cursor of an older one fails with STALE.
+//
+// An empty extent is an empty directory.
+class dir_format {
+public:
+    enum xxstatus {
+        OK, NOENT, EXIST, IOERR, STALE
+    };
+    typedef int status;
+
+    static const unsigned int max_name = 255;
+
+    dir_format(dir_io &io);
+
+    status lookup(const std::string &name, unsigned long long &inum);
+
+    status add(const std::string &name, unsigned long long inum);
+
+    status remove(const std::string &name);
+
+    status list(std::vector<dir_entry> &entries);
+
+    // up to count entries from cursor on, 0 being the start. cursors[i]
+    // resumes after entries[i]; an empty result means the end
+    status list(unsigned long long cursor, unsigned int count, std::vector<dir_entry> &entries,
+                std::vector<unsigned long long> &cursors);
+
+    // the image of a directory holding exactly these entries
+    static std::string build(const std::vector<dir_entry> &entries, uint32_t generation = 0);
+
+private:
+    struct header {
+        uint32_t magic;
+        uint32_t nbuckets;
+        uint32_t count;     // live entries
+        uint32_t end;       // of the last entry
+        uint32_t dead;      // bytes of removed entries
+        uint32_t generation;
+    };
+
+    struct entry_header {
+        uint32_t next;      // offset of the next entry in the bucket, or 0
+        uint32_t hash;
+        uint64_t inum;
+        uint16_t namelen;
+        uint16_t flags;
+        uint32_t pad;
+    };
+
+    enum {
+        DEAD = 1
+    };
+
+    // where an entry was found, and the link that points at it
+    struct position {
+        uint32_t off;
+        uint32_t link;
+        entry_header e;
+    };
+
+    dir_io &io;
+
+    static uint32_t hash(const std::string &name);
+
+    static uint32_t bucketOffset(uint32_t b);
+
+    status readHeader(header &h, bool &empty);
+
+    status find(const header &h, const std::string &name, position &pos);
+
+    status rebuild(const header *old, const std::vector<dir_entry> &entries);
+};
+
+#endif
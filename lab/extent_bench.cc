@@ -0,0 +1,176 @@
+//
+// extent server throughput benchmark
+//
+// runs 1, 2, 4, 8 and 16 clients against one extent server, each with its
+// own connection, and prints operations per second for a read-only, a
+// write-only and a mixed workload. the clients go straight to the rpc
+// interface, so no client cache hides the server.
+//
+
+#include "extent_protocol.h"
+#include "rpc.h"
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+enum workload {
+    READ, WRITE, MIXED
+};
+
+static const char *workload_names[] = {"read", "write", "mixed"};
+
+// every client writes its own extents and reads extents shared by all
+static const int nshared = 64;
+static const int nprivate = 16;
+static const unsigned int extent_bytes = 64 * 1024;
+static const unsigned int bs = extent_protocol::blocksize;
+
+static std::string dst;
+static int seconds = 3;
+
+struct bench_client {
+    int n;
+    workload w;
+    double stop;
+    unsigned long ops;
+    unsigned long errors;
+};
+
+static double
+now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static extent_protocol::extentid_t
+shared_id(int i) {
+    return 0x10000 + i;
+}
+
+static extent_protocol::extentid_t
+private_id(int client, int i) {
+    return 0x20000 + client * nprivate + i;
+}
+
+static rpcc *
+connect() {
+    sockaddr_in dstsock;
+    make_sockaddr(dst.c_str(), &dstsock);
+    rpcc *cl = new rpcc(dstsock);
+    if (cl->bind() < 0) {
+        fprintf(stderr, "extent_bench: cannot bind to %s\n", dst.c_str());
+        exit(1);
+    }
+    return cl;
+}
+
+static void *
+client_thread(void *x) {
+    bench_client *c = (bench_client *) x;
+    rpcc *cl = connect();
+    unsigned int seed = c->n + 1;
+    std::string block(bs, 'a' + c->n % 26);
+    std::string buf;
+    extent_protocol::attr a;
+    int r;
+
+    while (now() < c->stop) {
+        bool write = c->w == WRITE || (c->w == MIXED && rand_r(&seed) % 5 == 0);
+        unsigned long long off = (rand_r(&seed) % (extent_bytes / bs)) * bs;
+        extent_protocol::status ret;
+
+        if (write) {
+            ret = cl->call(extent_protocol::write, private_id(c->n, rand_r(&seed) % nprivate), off, block, r);
+        } else if (rand_r(&seed) % 2) {
+            ret = cl->call(extent_protocol::getattr, shared_id(rand_r(&seed) % nshared), a);
+        } else {
+            ret = cl->call(extent_protocol::read, shared_id(rand_r(&seed) % nshared), off, bs, buf);
+        }
+        if (ret != extent_protocol::OK) {
+            c->errors++;
+        }
+        c->ops++;
+    }
+
+    delete cl;
+    return 0;
+}
+
+static void
+run(workload w, int nclients) {
+    pthread_t th[nclients];
+    bench_client clients[nclients];
+    double start = now();
+
+    for (int i = 0; i < nclients; i++) {
+        clients[i].n = i;
+        clients[i].w = w;
+        clients[i].stop = start + seconds;
+        clients[i].ops = 0;
+        clients[i].errors = 0;
+        assert(pthread_create(&th[i], NULL, client_thread, &clients[i]) == 0);
+    }
+
+    unsigned long ops = 0, errors = 0;
+    for (int i = 0; i < nclients; i++) {
+        pthread_join(th[i], NULL);
+        ops += clients[i].ops;
+        errors += clients[i].errors;
+    }
+    double elapsed = now() - start;
+
+    printf("%-6s %3d clients %10.0f ops/sec", workload_names[w], nclients, ops / elapsed);
+    if (errors) {
+        printf("  (%lu errors)", errors);
+    }
+    printf("\n");
+}
+
+int
+main(int argc, char *argv[]) {
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s [host:]port [seconds]\n", argv[0]);
+        exit(1);
+    }
+    dst = argv[1];
+    if (argc > 2) {
+        seconds = atoi(argv[2]);
+    }
+
+    const int counts[] = {1, 2, 4, 8, 16};
+    const int maxclients = counts[sizeof(counts) / sizeof(counts[0]) - 1];
+
+    rpcc *cl = connect();
+    std::string contents(extent_bytes, 'x');
+    int r;
+    for (int i = 0; i < nshared; i++) {
+        assert(cl->call(extent_protocol::put, shared_id(i), contents, r) == extent_protocol::OK);
+    }
+    for (int c = 0; c < maxclients; c++) {
+        for (int i = 0; i < nprivate; i++) {
+            assert(cl->call(extent_protocol::put, private_id(c, i), contents, r) == extent_protocol::OK);
+        }
+    }
+
+    for (int w = READ; w <= MIXED; w++) {
+        for (unsigned int i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+            run((workload) w, counts[i]);
+        }
+    }
+
+    for (int i = 0; i < nshared; i++) {
+        cl->call(extent_protocol::remove, shared_id(i), r);
+    }
+    for (int c = 0; c < maxclients; c++) {
+        for (int i = 0; i < nprivate; i++) {
+            cl->call(extent_protocol::remove, private_id(c, i), r);
+        }
+    }
+    delete cl;
+    return 0;
+}
@@ -4,13 +4,66 @@
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
+#include <string.h>
+#include <assert.h>
 #include <unistd.h>
 #include <ctime>
+#include <climits>
+#include <algorithm>
 
 // The calls assume that the caller holds a lock on the extent
 
-extent_client::extent_client(std::string dst) {
+static const unsigned long long allChunks = ~0ULL;
+
+static void *
+writebackthread(void *x) {
+    extent_client *ec = (extent_client *) x;
+    ec->writebacker();
+    return 0;
+}
+
+static void *
+sendthread(void *x) {
+    extent_client *ec = (extent_client *) x;
+    ec->writeSender();
+    return 0;
+}
+
+static void *
+prefetchthread(void *x) {
+    extent_client *ec = (extent_client *) x;
+    ec->prefetcher();
+    return 0;
+}
+
+// prefetches beyond this many are dropped
+static const size_t max_prefetches = 64;
+
+// bitmap of the chunks touched by the byte range [from, to) of a page
+static unsigned long long
+chunkMask(unsigned int from, unsigned int to) {
+    unsigned int first = from / extent_client::chunksize;
+    unsigned int count = (to - 1) / extent_client::chunksize - first + 1;
+    return (count == 64 ? allChunks : ((1ULL << count) - 1)) << first;
+}
+
+// whether a call failed on the way rather than at the server, and may
+// go through if tried again
+static bool
+transient(extent_protocol::status ret) {
+    return ret < 0 || ret == extent_protocol::RPCERR;
+}
+
+extent_client::extent_client(std::string dst, size_t cacheBytes)
+        : extentHand(0), cachedBytes(0), cacheBudget(cacheBytes), dirtyBytes(0), remoteChanges(0) {
     pthread_mutex_init(&mapLock, NULL);
+    pthread_cond_init(&unpinCond, NULL);
+    pthread_cond_init(&writebackCond, NULL);
+    pthread_cond_init(&prefetchCond, NULL);
+    pthread_cond_init(&writebackQueueCond, NULL);
+    pthread_cond_init(&writebackDoneCond, NULL);
+    hand = ring.end();
+    memset(&counters, 0, sizeof(counters));
 
     sockaddr_in dstsock;
     make_sockaddr(dst.c_str(), &dstsock);
@@ -18,37 +71,716 @@ extent_client::extent_client(std::string dst) {
     if (cl->bind() != 0) {
         printf("extent_client: bind failed\n");
     }
+
+    pthread_t th;
+    int r = pthread_create(&th, NULL, &writebackthread, (void *) this);
+    assert(r == 0);
+    r = pthread_create(&th, NULL, &prefetchthread, (void *) this);
+    assert(r == 0);
+    for (unsigned int i = 0; i < writeback_threads; i++) {
+        r = pthread_create(&th, NULL, &sendthread, (void *) this);
+        assert(r == 0);
+    }
 }
 
+// find and pin the cache entry of an extent. a miss fetches the attributes,
+// and with them the pages covering [off, off + len) if len is not 0, in a
+// single round trip. assumes mapLock is held
 extent_protocol::status
-extent_client::get(extent_protocol::extentid_t eid, std::string &buf) {
-    std::cerr << "GET called, eid: " << eid << "\n";
+extent_client::lookup(extent_protocol::extentid_t eid, cached_extent *&ce, unsigned long long off,
+                      unsigned int len) {
+    while (true) {
+        auto it = cache.find(eid);
+        if (it != cache.end() && it->second.pinned) {
+            pthread_cond_wait(&unpinCond, &mapLock);
+            continue;
+        }
+        if (it != cache.end()) {
+            if (it->second.toDelete) {
+                return extent_protocol::NOENT;
+            }
+            ce = &it->second;
+            ce->pinned = true;
+            counters.hits++;
+            return extent_protocol::OK;
+        }
 
-    pthread_mutex_lock(&mapLock);
+        counters.misses++;
+        unsigned int first = off / pagesize;
+        unsigned int last = len > 0 ? (off + len - 1) / pagesize : 0;
+        extent_protocol::attr_data d;
+        extent_protocol::status ret;
+        if (len > 0) {
+            ret = call(extent_protocol::get_with_attr, eid, (unsigned long long) first * pagesize,
+                       (last - first + 1) * pagesize, d);
+        } else {
+            ret = call(extent_protocol::getattr, eid, d.a);
+        }
+        if (ret != extent_protocol::OK) {
+            return ret;
+        }
+        // someone else cached it while the lock was dropped
+        if (cache.find(eid) != cache.end()) {
+            continue;
+        }
+
+        ce = &insertExtent(eid);
+        ce->attr = d.a;
+        ce->remoteSize = d.a.size;
+        ce->pinned = true;
+        if (len > 0 && (unsigned long long) first * pagesize < d.a.size) {
+            storePages(eid, *ce, first, std::min(last, (unsigned int) ((d.a.size - 1) / pagesize)), d.data);
+        }
+        return extent_protocol::OK;
+    }
+}
+
+extent_client::cached_extent &
+extent_client::insertExtent(extent_protocol::extentid_t eid) {
+    auto res = cache.insert(std::make_pair(eid, cached_extent()));
+    if (res.second) {
+        cachedBytes += entrysize;
+    }
+    return res.first->second;
+}
+
+// the entry of an extent, created if needed, for the caller alone.
+// assumes mapLock is held
+extent_client::cached_extent &
+extent_client::pin(extent_protocol::extentid_t eid) {
+    while (true) {
+        cached_extent &ce = insertExtent(eid);
+        if (!ce.pinned) {
+            ce.pinned = true;
+            return ce;
+        }
+        pthread_cond_wait(&unpinCond, &mapLock);
+    }
+}
+
+void
+extent_client::unpin(cached_extent &ce) {
+    ce.pinned = false;
+    pthread_cond_broadcast(&unpinCond);
+}
+
+void
+extent_client::eraseExtent(std::map<extent_protocol::extentid_t, cached_extent>::iterator it) {
+    dropPages(it->second, 0);
+    cache.erase(it);
+    cachedBytes -= entrysize;
+}
+
+// number of leading bytes of the server copy that are still current. anything
+// past it is either beyond the end of the extent or about to be truncated away
+// and reads as zeroes.
+unsigned long long
+extent_client::remoteVisible(const cached_extent &ce) {
+    if (ce.createPending) {
+        return 0;
+    }
+    if (ce.truncatePending) {
+        return std::min(ce.remoteSize, ce.truncateTo);
+    }
+    return ce.remoteSize;
+}
+
+extent_client::page &
+extent_client::insertPage(extent_protocol::extentid_t eid, cached_extent &ce, unsigned int pageno) {
+    page &pg = ce.pages[pageno];
+    pg.data.assign(pagesize, '\0');
+    pg.valid = 0;
+    pg.dirty = 0;
+    pg.referenced = true;
+    // new pages go right behind the hand, so they survive a full sweep
+    pg.ring = ring.insert(hand, page_key(eid, pageno));
+    cachedBytes += pagesize;
+    return pg;
+}
+
+void
+extent_client::dropPage(cached_extent &ce, std::map<unsigned int, page>::iterator it) {
+    if (hand == it->second.ring) {
+        hand++;
+    }
+    // dropped dirty data is dead: the extent was replaced, removed or cut
+    setDirty(*it->second.ring, it->second, 0);
+    ring.erase(it->second.ring);
+    cachedBytes -= pagesize;
+    ce.pages.erase(it);
+}
+
+void
+extent_client::dropPages(cached_extent &ce, unsigned int from) {
+    auto it = ce.pages.lower_bound(from);
+    while (it != ce.pages.end()) {
+        dropPage(ce, it++);
+    }
+}
+
+// keep the set of dirty pages in step with the page's dirty bitmap
+void
+extent_client::setDirty(const page_key &key, page &pg, unsigned long long dirty) {
+    if (!pg.dirty && dirty) {
+        pg.dirtied = std::time(nullptr);
+        dirtyPages.insert(key);
+        dirtyBytes += pagesize;
+    } else if (pg.dirty && !dirty) {
+        dirtyPages.erase(key);
+        dirtyBytes -= pagesize;
+    }
+    pg.dirty = dirty;
+}
+
+// make the pages [first, last] fully valid, fetching every run of pages that
+// is not known yet with a single range read. assumes ce is pinned
+extent_protocol::status
+extent_client::loadPages(extent_protocol::extentid_t eid, cached_extent &ce,
+                         unsigned int first, unsigned int last) {
+    unsigned long long visible = remoteVisible(ce);
+    unsigned int p = first;
+
+    while (p <= last) {
+        auto it = ce.pages.find(p);
+        if (it != ce.pages.end() && it->second.valid == allChunks) {
+            counters.hits++;
+            p++;
+            continue;
+        }
+
+        unsigned int runEnd = p;
+        while (runEnd < last) {
+            auto next = ce.pages.find(runEnd + 1);
+            if (next != ce.pages.end() && next->second.valid == allChunks) {
+                break;
+            }
+            runEnd++;
+        }
+
+        unsigned long long off = (unsigned long long) p * pagesize;
+        unsigned long long end = std::min((unsigned long long) (runEnd + 1) * pagesize, visible);
+        std::string remote;
+
+        if (off < end) {
+            extent_protocol::status ret = call(extent_protocol::read, eid, off, (unsigned int) (end - off), remote);
+            if (ret != extent_protocol::OK) {
+                return ret;
+            }
+        }
+
+        storePages(eid, ce, p, runEnd, remote);
+        p = runEnd + 1;
+    }
+
+    return extent_protocol::OK;
+}
+
+// fill in the chunks of the pages [first, last] that are not known yet from
+// remote, the server's bytes from the start of page first on. what remote
+// does not cover lies past the end and reads as zeroes
+void
+extent_client::storePages(extent_protocol::extentid_t eid, cached_extent &ce, unsigned int first,
+                          unsigned int last, const std::string &remote) {
+    for (unsigned int p = first; p <= last; p++) {
+        auto pit = ce.pages.find(p);
+        page &pg = pit != ce.pages.end() ? pit->second : insertPage(eid, ce, p);
+        size_t base = (size_t) (p - first) * pagesize;
+
+        // keep the chunks we know
+        for (unsigned int c = 0; c < 64; c++) {
+            if (pg.valid & (1ULL << c)) {
+                continue;
+            }
+            size_t from = base + c * chunksize;
+            if (from < remote.size()) {
+                size_t n = std::min((size_t) chunksize, remote.size() - from);
+                memcpy(&pg.data[c * chunksize], remote.data() + from, n);
+            }
+        }
+        pg.valid = allChunks;
+        pg.referenced = true;
+        counters.misses++;
+    }
+}
+
+// assumes the pages covering [off, off + len) are valid
+void
+extent_client::copyOut(cached_extent &ce, unsigned long long off, unsigned int len, std::string &buf) {
+    buf.resize(len);
+
+    size_t done = 0;
+    while (done < len) {
+        unsigned long long pos = off + done;
+        unsigned int pageOff = pos % pagesize;
+        size_t n = std::min((size_t) (pagesize - pageOff), len - done);
+
+        page &pg = ce.pages.at(pos / pagesize);
+        memcpy(&buf[done], pg.data.data() + pageOff, n);
+        pg.referenced = true;
+
+        done += n;
+    }
+}
+
+// assumes that every chunk only partially covered by the range is valid
+void
+extent_client::copyIn(extent_protocol::extentid_t eid, cached_extent &ce, unsigned long long off,
+                      const char *data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        unsigned long long pos = off + done;
+        unsigned int pageno = pos / pagesize;
+        unsigned int pageOff = pos % pagesize;
+        size_t n = std::min((size_t) (pagesize - pageOff), len - done);
+
+        auto it = ce.pages.find(pageno);
+        page &pg = it != ce.pages.end() ? it->second : insertPage(eid, ce, pageno);
+        memcpy(&pg.data[pageOff], data + done, n);
+
+        unsigned long long mask = chunkMask(pageOff, pageOff + n);
+        pg.valid |= mask;
+        setDirty(page_key(eid, pageno), pg, pg.dirty | mask);
+        pg.referenced = true;
+
+        done += n;
+    }
+}
+
+// send the create or truncate that has to precede the dirty pages.
+// assumes ce is pinned, as do the other write back functions
+extent_protocol::status
+extent_client::writebackPending(extent_protocol::extentid_t eid, cached_extent &ce) {
+    extent_protocol::status ret = extent_protocol::OK;
+    int r;
+
+    if (ce.createPending) {
+        if ((ret = call(extent_protocol::put, eid, std::string(), r)) == extent_protocol::OK) {
+            ce.createPending = false;
+            ce.truncatePending = false;
+            ce.remoteSize = 0;
+        }
+    } else if (ce.truncatePending) {
+        if ((ret = call(extent_protocol::truncate, eid, ce.truncateTo, r)) == extent_protocol::OK) {
+            ce.truncatePending = false;
+            ce.remoteSize = ce.truncateTo;
+        }
+    }
+
+    return ret;
+}
+
+// cut the dirty chunks of the pages into runs, each written back with one
+// RPC. a run that reaches the end of a page goes on into the dirty chunks at
+// the start of the following pages, up to writeback_pages pages, so
+// sequential writes go back in a few large RPCs instead of one per page.
+// only runs starting in the pages [first, last] are collected
+void
+extent_client::collectRuns(extent_protocol::extentid_t eid, cached_extent &ce, unsigned int first,
+                           unsigned int last, std::vector<writeback_run> &runs) {
+    bool open = false;
+
+    for (auto it = ce.pages.lower_bound(first); it != ce.pages.end(); it++) {
+        page &pg = it->second;
+        for (unsigned int c = 0; c < 64;) {
+            if (!(pg.dirty & (1ULL << c))) {
+                open = false;
+                c++;
+                continue;
+            }
+
+            bool extend = false;
+            if (open && c == 0) {
+                writeback_run::piece &prev = runs.back().pieces.back();
+                extend = prev.pageno + 1 == it->first && prev.to == 64 &&
+                         runs.back().pieces.size() < writeback_pages;
+            }
+            if (!extend) {
+                if (it->first > last) {
+                    return;
+                }
+                runs.push_back(writeback_run());
+                runs.back().eid = eid;
+                runs.back().ce = &ce;
+                runs.back().off = (unsigned long long) it->first * pagesize + c * chunksize;
+            }
+
+            writeback_run::piece p = {it->first, &pg, c, c};
+            while (p.to < 64 && (pg.dirty & (1ULL << p.to))) {
+                p.to++;
+            }
+            runs.back().pieces.push_back(p);
+            open = true;
+            c = p.to;
+        }
+    }
+}
+
+// the bytes of a run; nothing past the end of the extent has to reach the
+// server
+void
+extent_client::runData(writeback_run &run) {
+    run.data.clear();
+    for (auto &p : run.pieces) {
+        unsigned long long pageStart = (unsigned long long) p.pageno * pagesize;
+        unsigned long long from = pageStart + p.from * chunksize;
+        unsigned long long to = std::min(pageStart + p.to * chunksize, (unsigned long long) run.ce->attr.size);
+        if (from < to) {
+            run.data.append(p.pg->data, from - pageStart, to - from);
+        }
+    }
+}
+
+// the chunks of a run that made it to the server are clean
+void
+extent_client::runDone(writeback_run &run) {
+    if (!run.data.empty()) {
+        run.ce->remoteSize = std::max(run.ce->remoteSize, run.off + run.data.size());
+        counters.writebacks++;
+    }
+    for (auto &p : run.pieces) {
+        setDirty(*p.pg->ring, *p.pg, p.pg->dirty & ~chunkMask(p.from * chunksize, p.to * chunksize));
+    }
+    std::string().swap(run.data);
+}
+
+// write runs of pinned extents back. a single run is sent right away; more
+// go through the write back pool, up to writeback_window at a time. runs
+// that fail stay dirty, and the first failure is returned. assumes
+// writebackPending went through for every extent
+extent_protocol::status
+extent_client::writeRuns(std::vector<writeback_run> &runs) {
     extent_protocol::status ret = extent_protocol::OK;
+    int r;
+
+    if (runs.size() == 1) {
+        runData(runs[0]);
+        if (!runs[0].data.empty()) {
+            ret = call(extent_protocol::write, runs[0].eid, runs[0].off, runs[0].data, r);
+        }
+        if (ret == extent_protocol::OK) {
+            runDone(runs[0]);
+        }
+        return ret;
+    }
+
+    size_t next = 0, reaped = 0;
+    while (reaped < runs.size()) {
+        for (; next < runs.size() && next - reaped < writeback_window; next++) {
+            writeback_run &run = runs[next];
+            runData(run);
+            run.ret = extent_protocol::OK;
+            run.done = run.data.empty();
+            if (!run.done) {
+                writebackQueue.push_back(&run);
+                pthread_cond_signal(&writebackQueueCond);
+            }
+        }
+
+        // runs complete in any order; the window moves on in order
+        while (!runs[reaped].done) {
+            pthread_cond_wait(&writebackDoneCond, &mapLock);
+        }
+        for (; reaped < next && runs[reaped].done; reaped++) {
+            if (runs[reaped].ret == extent_protocol::OK) {
+                runDone(runs[reaped]);
+            } else if (ret == extent_protocol::OK) {
+                ret = runs[reaped].ret;
+            }
+        }
+    }
+
+    return ret;
+}
+
+// one of the write back pool. the runs belong to the threads in writeRuns,
+// which keep them until they are done
+void
+extent_client::writeSender() {
+    int r;
+
+    pthread_mutex_lock(&mapLock);
+    while (true) {
+        while (writebackQueue.empty()) {
+            pthread_cond_wait(&writebackQueueCond, &mapLock);
+        }
+        writeback_run *run = writebackQueue.front();
+        writebackQueue.pop_front();
+
+        run->ret = call(extent_protocol::write, run->eid, run->off, run->data, r);
+        run->done = true;
+        pthread_cond_broadcast(&writebackDoneCond);
+    }
+}
+
+// write the runs that start in a page. assumes writebackPending went through
+extent_protocol::status
+extent_client::writebackPage(extent_protocol::extentid_t eid, cached_extent &ce, unsigned int pageno) {
+    std::vector<writeback_run> runs;
+    collectRuns(eid, ce, pageno, pageno, runs);
+    return writeRuns(runs);
+}
+
+// bring everything the server is missing about an extent up to date: a
+// remove, or the size changes, the dirty chunks and the final size
+extent_protocol::status
+extent_client::writebackExtent(extent_protocol::extentid_t eid, cached_extent &ce) {
+    extent_protocol::status ret;
+    int r;
+
+    if (ce.toDelete) {
+        std::cerr << "Propagate delete of extent " << eid << " to extent server\n";
+        return call(extent_protocol::remove, eid, r);
+    }
+
+    // only the dirty chunks travel, after the size changes they depend on
+    if ((ret = writebackPending(eid, ce)) != extent_protocol::OK) {
+        return ret;
+    }
+    std::vector<writeback_run> runs;
+    collectRuns(eid, ce, 0, UINT_MAX, runs);
+    if (!runs.empty()) {
+        std::cerr << "Propagate " << runs.size() << " runs of extent " << eid << "\n";
+        if ((ret = writeRuns(runs)) != extent_protocol::OK) {
+            return ret;
+        }
+    }
+    if (ce.remoteSize != ce.attr.size) {
+        if ((ret = call(extent_protocol::truncate, eid, (unsigned long long) ce.attr.size, r)) !=
+            extent_protocol::OK) {
+            return ret;
+        }
+        ce.remoteSize = ce.attr.size;
+    }
+
+    return extent_protocol::OK;
+}
+
+// run the CLOCK hand until the cache fits into target bytes. dirty pages are
+// written back before they are dropped; pages that cannot be written back
+// and pages of pinned extents stay cached. assumes mapLock is held
+void
+extent_client::evict(size_t target) {
+    size_t steps = 2 * ring.size();
+
+    while (cachedBytes > target && steps-- > 0) {
+        if (hand == ring.end()) {
+            hand = ring.begin();
+        }
+
+        page_key key = *hand;
+        cached_extent &ce = cache.at(key.first);
+        auto it = ce.pages.find(key.second);
+        page &pg = it->second;
+
+        if (ce.pinned) {
+            hand++;
+            continue;
+        }
+        if (pg.referenced) {
+            pg.referenced = false;
+            hand++;
+            continue;
+        }
+
+        if (pg.dirty) {
+            ce.pinned = true;
+            bool failed = writebackPending(key.first, ce) != extent_protocol::OK ||
+                          writebackPage(key.first, ce, key.second) != extent_protocol::OK;
+            unpin(ce);
+            // the hand may have moved on while the lock was dropped; then
+            // the page is left to the next sweep
+            bool moved = hand == ring.end() || *hand != key;
+            if (failed && !moved) {
+                hand++;
+            }
+            if (failed || moved) {
+                continue;
+            }
+        }
+
+        std::cerr << "EVICT page " << key.second << " of extent " << key.first << "\n";
+        dropPage(ce, it);
+        counters.evictions++;
+    }
+
+    if (cachedBytes > target) {
+        evictExtents(target);
+    }
+}
+
+// drop extents that have no pages left, round robin over the extent ids.
+// what the server is missing is written back first, just like on a revoke.
+// assumes mapLock is held
+void
+extent_client::evictExtents(size_t target) {
+    size_t steps = cache.size();
+    auto it = cache.upper_bound(extentHand);
+
+    while (cachedBytes > target && steps-- > 0) {
+        if (it == cache.end()) {
+            it = cache.begin();
+        }
+        extentHand = it->first;
+
+        if (!it->second.pages.empty() || it->second.pinned) {
+            it++;
+            continue;
+        }
+        it->second.pinned = true;
+        bool failed = writebackExtent(it->first, it->second) != extent_protocol::OK;
+        unpin(it->second);
+        // pages may have come back while the lock was dropped
+        if (failed || !it->second.pages.empty()) {
+            it++;
+            continue;
+        }
+
+        std::cerr << "EVICT extent " << it->first << "\n";
+        eraseExtent(it++);
+        counters.evictions++;
+    }
+}
+
+// called at the end of every operation. the budget is a hard limit on the
+// request path; before it is reached the background writer gets to clean
+// and drop pages. assumes mapLock is held
+void
+extent_client::trim() {
+    if (cachedBytes > cacheBudget) {
+        evict(cacheBudget);
+    }
+    if (dirtyBytes > cacheBudget / 2 || cachedBytes > cacheBudget / 10 * 9) {
+        pthread_cond_signal(&writebackCond);
+    }
+}
+
+// background writer. once half the budget is dirty it writes back until
+// only a quarter is; below that it writes back what has been dirty for
+// writeback_age seconds, so that a revoke finds little left to do. the runs
+// of up to writeback_extents extents go out together through the pool. once
+// the cache is 90% full it evicts down to 80%.
+void
+extent_client::writebacker() {
+    time_t lastPrint = 0;
+
+    pthread_mutex_lock(&mapLock);
+    while (true) {
+        if (dirtyBytes <= cacheBudget / 2 && cachedBytes <= cacheBudget / 10 * 9) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += 1;
+            pthread_cond_timedwait(&writebackCond, &mapLock, &until);
+        }
+
+        bool pressed = dirtyBytes > cacheBudget / 2;
+        bool failed = false;
+        while (!failed) {
+            pressed = pressed && dirtyBytes > cacheBudget / 4;
+            time_t oldest = std::time(nullptr) - writeback_age;
+
+            // pinned extents are busy with a request; take the next ones
+            std::vector<extent_protocol::extentid_t> batch;
+            for (auto &key : dirtyPages) {
+                if (batch.size() == writeback_extents) {
+                    break;
+                }
+                cached_extent &ce = cache.at(key.first);
+                if (ce.pinned || (!pressed && ce.pages.at(key.second).dirtied > oldest)) {
+                    continue;
+                }
+                ce.pinned = true;
+                batch.push_back(key.first);
+            }
+            if (batch.empty()) {
+                if (!pressed) {
+                    break;
+                }
+                pthread_cond_wait(&unpinCond, &mapLock);
+                continue;
+            }
 
-    if (files.find(eid) != files.end() && (!toDelete[eid])) {
-        std::cerr << "GET called, eid: " << eid << ". Load cached value\n";
-        buf = files[eid];
-    } else if (files.find(eid) != files.end() && (toDelete[eid])) {
-        ret = extent_protocol::NOENT;
-    } else {
-        std::cerr << "GET called, eid: " << eid << ". Retrieve value from server\n";
-        // CALL SERVER, ASK FOR DATA
-        ret = cl->call(extent_protocol::get, eid, buf);
-        files[eid] = buf;
+            std::vector<writeback_run> runs;
+            for (auto eid : batch) {
+                cached_extent &ce = cache.at(eid);
+                if (writebackPending(eid, ce) == extent_protocol::OK) {
+                    collectRuns(eid, ce, 0, UINT_MAX, runs);
+                } else {
+                    failed = true;
+                }
+            }
+            failed = writeRuns(runs) != extent_protocol::OK || failed;
+            for (auto eid : batch) {
+                unpin(cache.at(eid));
+            }
+        }
+        evict(cacheBudget / 10 * 8);
 
-        extent_protocol::attr &attr = attributes[eid];
-        ret = cl->call(extent_protocol::getattr, eid, attr);
+        if (std::time(nullptr) - lastPrint >= 10) {
+            lastPrint = std::time(nullptr);
+            pthread_mutex_unlock(&mapLock);
+            printStats();
+            pthread_mutex_lock(&mapLock);
+        }
 
-        // new file, can't be dirty yet
-        isDirty[eid] = false;
-        toDelete[eid] = false;
+        // the server is unreachable; don't spin until it's back
+        if (failed || cachedBytes > cacheBudget / 10 * 9) {
+            pthread_mutex_unlock(&mapLock);
+            sleep(1);
+            pthread_mutex_lock(&mapLock);
+        }
     }
+}
 
-    attributes[eid].atime = std::time(nullptr);
+void
+extent_client::prefetcher() {
+    pthread_mutex_lock(&mapLock);
+    while (true) {
+        while (prefetchQueue.empty()) {
+            pthread_cond_wait(&prefetchCond, &mapLock);
+        }
+        prefetch_range pr = prefetchQueue.front();
+        prefetchQueue.pop_front();
 
-    std::cerr << "GET called, eid: " << eid << ". Return value: " << buf << "\n";
+        // only what is still cached, see above
+        auto it = cache.find(pr.eid);
+        while (it != cache.end() && it->second.pinned) {
+            pthread_cond_wait(&unpinCond, &mapLock);
+            it = cache.find(pr.eid);
+        }
+        if (it == cache.end() || it->second.toDelete || pr.off >= it->second.attr.size) {
+            continue;
+        }
+
+        cached_extent &ce = it->second;
+        unsigned long long end = std::min(pr.off + pr.len, (unsigned long long) ce.attr.size);
+        ce.pinned = true;
+        if (loadPages(pr.eid, ce, pr.off / pagesize, (end - 1) / pagesize) == extent_protocol::OK) {
+            counters.prefetches++;
+        }
+        unpin(ce);
+        trim();
+    }
+}
+
+extent_protocol::status
+extent_client::get(extent_protocol::extentid_t eid, std::string &buf) {
+    std::cerr << "GET called, eid: " << eid << "\n";
+
+    pthread_mutex_lock(&mapLock);
+    cached_extent *ce;
+    extent_protocol::status ret = lookup(eid, ce, 0, extent_protocol::maxextent);
+
+    if (ret == extent_protocol::OK) {
+        if (ce->attr.size > 0) {
+            ret = loadPages(eid, *ce, 0, (ce->attr.size - 1) / pagesize);
+        }
+        if (ret == extent_protocol::OK) {
+            copyOut(*ce, 0, ce->attr.size, buf);
+            ce->attr.atime = std::time(nullptr);
+        }
+        unpin(*ce);
+        trim();
+    }
 
     pthread_mutex_unlock(&mapLock);
     return ret;
@@ -60,17 +792,13 @@ extent_client::getattr(extent_protocol::extentid_t eid,
     std::cerr << "GETATTR called, eid: " << eid << "\n";
 
     pthread_mutex_lock(&mapLock);
-    extent_protocol::status ret = extent_protocol::OK;
+    cached_extent *ce;
+    extent_protocol::status ret = lookup(eid, ce);
 
-    if (attributes.find(eid) != attributes.end() && (!toDelete[eid])) {
-        attr = attributes.at(eid);
-    } else if (attributes.find(eid) != attributes.end() && (toDelete[eid])) {
-        ret = extent_protocol::NOENT;
-    } else {
-        // CALL SERVER, ASK FOR ATTRIBUTES
-        extent_protocol::attr &a = attributes[eid];
-        ret = cl->call(extent_protocol::getattr, eid, a);
-        attr = a;
+    if (ret == extent_protocol::OK) {
+        attr = ce->attr;
+        unpin(*ce);
+        trim();
     }
 
     pthread_mutex_unlock(&mapLock);
@@ -79,26 +807,35 @@ extent_client::getattr(extent_protocol::extentid_t eid,
 
 extent_protocol::status
 extent_client::put(extent_protocol::extentid_t eid, std::string buf) {
-    std::cerr << "PUT called, eid: " << eid << "Store value: " << buf << "\n";
+    std::cerr << "PUT called, eid: " << eid << ", size: " << buf.size() << "\n";
 
     pthread_mutex_lock(&mapLock);
     extent_protocol::status ret = extent_protocol::OK;
 
-    // set data
-    files[eid] = buf;
+    // replaces the extent, whether we know it or not
+    cached_extent &ce = pin(eid);
+    dropPages(ce, 0);
+    ce.toDelete = false;
+    ce.remoteSize = 0;
+    ce.createPending = true;
+    ce.truncatePending = false;
+    ce.truncateTo = 0;
+
+    copyIn(eid, ce, 0, buf.data(), buf.size());
+    // the tail of the last page lies past the end and is known to be zero
+    if (buf.size() % pagesize != 0) {
+        ce.pages.at(buf.size() / pagesize).valid = allChunks;
+    }
 
     // create and set attributes
-    extent_protocol::attr newAttr;
-    newAttr.size = buf.size();
+    ce.attr.size = buf.size();
     time_t currTime = std::time(nullptr);
-    newAttr.atime = currTime;
-    newAttr.mtime = currTime;
-    newAttr.ctime = currTime;
-    attributes[eid] = newAttr;
+    ce.attr.atime = currTime;
+    ce.attr.mtime = currTime;
+    ce.attr.ctime = currTime;
 
-    // mark data as dirty
-    isDirty[eid] = true;
-    toDelete[eid] = false;
+    unpin(ce);
+    trim();
 
     pthread_mutex_unlock(&mapLock);
     return ret;
@@ -112,7 +849,240 @@ extent_client::remove(extent_protocol::extentid_t eid) {
     extent_protocol::status ret = extent_protocol::OK;
 
     // file should be marked as deleted
-    toDelete[eid] = true;
+    cached_extent &ce = pin(eid);
+    dropPages(ce, 0);
+    ce.toDelete = true;
+    ce.createPending = false;
+    ce.truncatePending = false;
+
+    unpin(ce);
+    trim();
+
+    pthread_mutex_unlock(&mapLock);
+    return ret;
+}
+
+// collects a read into a string
+class string_reader : public extent_reader {
+    std::string &buf;
+
+public:
+    string_reader(std::string &buf) : buf(buf) {}
+
+    void consume(const struct iovec *iov, int count) {
+        buf.clear();
+        for (int i = 0; i < count; i++) {
+            buf.append((const char *) iov[i].iov_base, iov[i].iov_len);
+        }
+    }
+};
+
+extent_protocol::status
+extent_client::read(extent_protocol::extentid_t eid, unsigned long long off, unsigned int len,
+                    std::string &buf) {
+    string_reader reader(buf);
+    return read(eid, off, len, reader);
+}
+
+extent_protocol::status
+extent_client::read(extent_protocol::extentid_t eid, unsigned long long off, unsigned int len,
+                    extent_reader &reader) {
+    std::cerr << "READ called, eid: " << eid << ", off: " << off << ", len: " << len << "\n";
+
+    pthread_mutex_lock(&mapLock);
+    cached_extent *ce;
+    extent_protocol::status ret = lookup(eid, ce, off, len);
+
+    if (ret == extent_protocol::OK) {
+        // reads are clipped to the end of the extent
+        if (off >= ce->attr.size) {
+            len = 0;
+        } else if (off + len > ce->attr.size) {
+            len = ce->attr.size - off;
+        }
+
+        if (len > 0) {
+            ret = loadPages(eid, *ce, off / pagesize, (off + len - 1) / pagesize);
+        }
+        if (ret == extent_protocol::OK) {
+            std::vector<struct iovec> iov;
+            for (unsigned int done = 0; done < len;) {
+                unsigned long long pos = off + done;
+                unsigned int pageOff = pos % pagesize;
+                unsigned int n = std::min(pagesize - pageOff, len - done);
+
+                page &pg = ce->pages.at(pos / pagesize);
+                pg.referenced = true;
+                struct iovec v = {&pg.data[pageOff], n};
+                iov.push_back(v);
+
+                done += n;
+            }
+            ce->attr.atime = std::time(nullptr);
+
+            // the pin keeps the pages in place and unchanged
+            pthread_mutex_unlock(&mapLock);
+            reader.consume(iov.data(), iov.size());
+            pthread_mutex_lock(&mapLock);
+        }
+        unpin(*ce);
+        trim();
+    }
+
+    pthread_mutex_unlock(&mapLock);
+    return ret;
+}
+
+void
+extent_client::prefetch(extent_protocol::extentid_t eid, unsigned long long off, unsigned int len) {
+    pthread_mutex_lock(&mapLock);
+    if (len > 0 && prefetchQueue.size() < max_prefetches) {
+        prefetch_range pr = {eid, off, len};
+        prefetchQueue.push_back(pr);
+        pthread_cond_signal(&prefetchCond);
+    }
+    pthread_mutex_unlock(&mapLock);
+}
+
+// an extent may change on the server while the call is out: a lock that is
+// released may already be with another client, and this client changes
+// directories and creates and removes files on the server. such changes
+// count in remoteChanges, which is read before the locks are asked, and
+// then the whole batch is dropped
+void
+extent_client::prefetchAttrs(const std::vector<extent_protocol::extentid_t> &ids, extent_locks &locks) {
+    pthread_mutex_lock(&mapLock);
+    unsigned long long before = remoteChanges;
+    pthread_mutex_unlock(&mapLock);
+
+    std::vector<extent_protocol::extentid_t> held;
+    for (auto eid : ids) {
+        if (locks.held(eid)) {
+            held.push_back(eid);
+        }
+    }
+
+    pthread_mutex_lock(&mapLock);
+    std::vector<extent_protocol::extentid_t> wanted;
+    for (auto eid : held) {
+        if (cache.find(eid) == cache.end()) {
+            wanted.push_back(eid);
+        }
+    }
+
+    std::vector<extent_protocol::attr_status> attrs;
+    if (!wanted.empty() && call(extent_protocol::getattrs, wanted, attrs) == extent_protocol::OK &&
+        attrs.size() == wanted.size() && remoteChanges == before) {
+        for (size_t i = 0; i < wanted.size(); i++) {
+            if (attrs[i].ret != extent_protocol::OK || cache.find(wanted[i]) != cache.end()) {
+                continue;
+            }
+            cached_extent &ce = insertExtent(wanted[i]);
+            ce.attr = attrs[i].a;
+            ce.remoteSize = attrs[i].a.size;
+        }
+        trim();
+    }
+    pthread_mutex_unlock(&mapLock);
+}
+
+extent_protocol::status
+extent_client::write(extent_protocol::extentid_t eid, unsigned long long off, const std::string &data) {
+    return write(eid, off, data.data(), data.size());
+}
+
+extent_protocol::status
+extent_client::write(extent_protocol::extentid_t eid, unsigned long long off, const char *data, size_t len) {
+    std::cerr << "WRITE called, eid: " << eid << ", off: " << off << ", len: " << len << "\n";
+
+    // the server could never take the cached write back
+    if (off + len > UINT_MAX) {
+        return extent_protocol::FBIG;
+    }
+
+    pthread_mutex_lock(&mapLock);
+    cached_extent *ce;
+    extent_protocol::status ret = lookup(eid, ce);
+
+    if (ret == extent_protocol::OK && len == 0) {
+        unpin(*ce);
+    } else if (ret == extent_protocol::OK) {
+        unsigned long long end = off + len;
+        unsigned long long visible = remoteVisible(*ce);
+
+        // chunks the write only partially covers have to be known first,
+        // unless they lie in the part of the extent that reads as zeroes
+        unsigned long long edges[2] = {off, end};
+        for (int i = 0; i < 2 && ret == extent_protocol::OK; i++) {
+            if (edges[i] % chunksize == 0) {
+                continue;
+            }
+            unsigned long long pos = i == 0 ? off : end - 1;
+            unsigned int pageno = pos / pagesize;
+            unsigned long long chunkStart = pos - pos % chunksize;
+            auto it = ce->pages.find(pageno);
+            bool known = it != ce->pages.end() &&
+                         (it->second.valid & chunkMask(pos % pagesize, pos % pagesize + 1));
+
+            if (!known && chunkStart < visible) {
+                ret = loadPages(eid, *ce, pageno, pageno);
+            }
+        }
+
+        if (ret == extent_protocol::OK) {
+            copyIn(eid, *ce, off, data, len);
+
+            if (end > ce->attr.size) {
+                ce->attr.size = end;
+            }
+            ce->attr.mtime = ce->attr.ctime = std::time(nullptr);
+        }
+        unpin(*ce);
+        trim();
+    }
+
+    pthread_mutex_unlock(&mapLock);
+    return ret;
+}
+
+extent_protocol::status
+extent_client::truncate(extent_protocol::extentid_t eid, unsigned long long size) {
+    std::cerr << "TRUNCATE called, eid: " << eid << ", size: " << size << "\n";
+
+    if (size > UINT_MAX) {
+        return extent_protocol::FBIG;
+    }
+
+    pthread_mutex_lock(&mapLock);
+    cached_extent *ce;
+    extent_protocol::status ret = lookup(eid, ce);
+
+    if (ret == extent_protocol::OK) {
+        if (size < ce->attr.size) {
+            dropPages(*ce, (size + pagesize - 1) / pagesize);
+
+            // zero the cut-off tail of the last page; the server drops it too
+            // once the truncate is written back
+            unsigned int tail = size % pagesize;
+            auto it = ce->pages.find(size / pagesize);
+            if (tail != 0 && it != ce->pages.end()) {
+                page &pg = it->second;
+                memset(&pg.data[tail], 0, pagesize - tail);
+                unsigned int firstBeyond = (tail + chunksize - 1) / chunksize;
+                unsigned long long beyond = firstBeyond < 64 ? chunkMask(firstBeyond * chunksize, pagesize) : 0;
+                pg.valid |= beyond;
+                setDirty(page_key(eid, size / pagesize), pg, pg.dirty & ~beyond);
+            }
+
+            ce->truncateTo = ce->truncatePending ? std::min(ce->truncateTo, size) : size;
+            ce->truncatePending = true;
+        }
+
+        ce->attr.size = size;
+        ce->attr.mtime = ce->attr.ctime = std::time(nullptr);
+        unpin(*ce);
+        trim();
+    }
 
     pthread_mutex_unlock(&mapLock);
     return ret;
@@ -124,25 +1094,196 @@ extent_client::flush(extent_protocol::extentid_t eid) {
     std::cerr << "FLUSH called, eid: " << eid << "\n";
 
     extent_protocol::status ret = extent_protocol::OK;
+
+    uncache(eid);
+    changed(eid);
+
+    pthread_mutex_unlock(&mapLock);
+    return ret;
+}
+
+// write back and forget what is cached of eid, so the server holds the
+// current extent. changes the server refuses, say of an extent removed
+// meanwhile, are dropped. assumes mapLock is held
+void
+extent_client::uncache(extent_protocol::extentid_t eid) {
+    auto it = cache.find(eid);
+    while (it != cache.end() && it->second.pinned) {
+        pthread_cond_wait(&unpinCond, &mapLock);
+        it = cache.find(eid);
+    }
+    if (it != cache.end()) {
+        it->second.pinned = true;
+        // the server is unreachable; back off until it's back
+        extent_protocol::status ret;
+        for (useconds_t delay = 1000; transient(ret = writebackExtent(eid, it->second));
+             delay = std::min(2 * delay, (useconds_t) 1000000)) {
+            pthread_mutex_unlock(&mapLock);
+            usleep(delay);
+            pthread_mutex_lock(&mapLock);
+        }
+        if (ret != extent_protocol::OK) {
+            std::cerr << "uncache: server refused extent " << eid << " with " << ret << ", dropping it\n";
+        }
+        eraseExtent(it);
+        pthread_cond_broadcast(&unpinCond);
+    }
+}
+
+// forget what is cached of eid without writing it back, for extents the
+// server is about to replace or remove. assumes mapLock is held
+void
+extent_client::discard(extent_protocol::extentid_t eid) {
+    auto it = cache.find(eid);
+    while (it != cache.end() && it->second.pinned) {
+        pthread_cond_wait(&unpinCond, &mapLock);
+        it = cache.find(eid);
+    }
+    if (it != cache.end()) {
+        eraseExtent(it);
+    }
+}
+
+// the server's copy of eid was changed behind the cache, or may be changed
+// by another client from now on. attributes that prefetchAttrs fetched in
+// the meantime are stale. assumes mapLock is held
+void
+extent_client::changed(extent_protocol::extentid_t eid) {
+    discard(eid);
+    remoteChanges++;
+}
+
+// the directory operations work on the server's copy, so a cached copy,
+// such as the empty extent of a new directory, is written back first and
+// nothing of the directory stays cached afterwards
+extent_protocol::status
+extent_client::dir_lookup(extent_protocol::extentid_t eid, const std::string &name, unsigned long long &inum) {
+    pthread_mutex_lock(&mapLock);
+    uncache(eid);
+    pthread_mutex_unlock(&mapLock);
+
+    return cl->call(extent_protocol::dir_lookup, eid, name, inum);
+}
+
+extent_protocol::status
+extent_client::dir_add(extent_protocol::extentid_t eid, const std::string &name, unsigned long long inum) {
     int r;
 
-    if (files.find(eid) != files.end()) {
-        if (toDelete[eid]) {
-            std::cerr << "Propagate delete of extent " << eid << " to extent server\n";
-            while (cl->call(extent_protocol::remove, eid, r) != extent_protocol::OK);
-        } else if (isDirty[eid]) {
-            std::cerr << "Propagate update of extent " << eid << " to extent server. Value: " << files[eid] << "\n";
-            while (cl->call(extent_protocol::put, eid, files[eid], r) != extent_protocol::OK);
+    pthread_mutex_lock(&mapLock);
+    uncache(eid);
+    extent_protocol::status ret = call(extent_protocol::dir_add, eid, name, inum, r);
+    changed(eid);
+    pthread_mutex_unlock(&mapLock);
+    return ret;
+}
+
+extent_protocol::status
+extent_client::dir_remove(extent_protocol::extentid_t eid, const std::string &name) {
+    int r;
+
+    pthread_mutex_lock(&mapLock);
+    uncache(eid);
+    extent_protocol::status ret = call(extent_protocol::dir_remove, eid, name, r);
+    changed(eid);
+    pthread_mutex_unlock(&mapLock);
+    return ret;
+}
+
+extent_protocol::status
+extent_client::dir_list(extent_protocol::extentid_t eid, unsigned long long cursor, unsigned int count,
+                        extent_protocol::dirlist &list) {
+    pthread_mutex_lock(&mapLock);
+    uncache(eid);
+    pthread_mutex_unlock(&mapLock);
+
+    return cl->call(extent_protocol::dir_list, eid, cursor, count, list);
+}
+
+extent_protocol::status
+extent_client::alloc(unsigned int count, unsigned long long &first) {
+    return cl->call(extent_protocol::alloc, count, first);
+}
+
+// the ops work on the server's copy: directories are written back first,
+// extents that are put or removed are dropped. those stay pinned through the
+// call, which keeps the writer off them, and are only dropped once it went
+// through; after a failed call they keep what they had cached. an empty
+// extent that was put is cached again afterwards, as it now is on the server
+extent_protocol::status
+extent_client::compound(const std::vector<extent_protocol::compound_op> &ops) {
+    pthread_mutex_lock(&mapLock);
+    for (auto &op : ops) {
+        if (op.type == extent_protocol::compound_op::DIR_ADD || op.type == extent_protocol::compound_op::DIR_REMOVE) {
+            uncache(op.id);
+        }
+    }
+    std::vector<extent_protocol::extentid_t> pinned;
+    for (auto &op : ops) {
+        if (op.type == extent_protocol::compound_op::DIR_ADD || op.type == extent_protocol::compound_op::DIR_REMOVE ||
+            std::find(pinned.begin(), pinned.end(), op.id) != pinned.end()) {
+            continue;
         }
+        auto it = cache.find(op.id);
+        while (it != cache.end() && it->second.pinned) {
+            pthread_cond_wait(&unpinCond, &mapLock);
+            it = cache.find(op.id);
+        }
+        if (it != cache.end()) {
+            it->second.pinned = true;
+            pinned.push_back(op.id);
+        }
+    }
 
-        files.erase(eid);
-        attributes.erase(eid);
-        toDelete.erase(eid);
-        isDirty.erase(eid);
+    unsigned int failed;
+    extent_protocol::status ret = call(extent_protocol::compound, ops, failed);
+    for (auto eid : pinned) {
+        auto it = cache.find(eid);
+        if (ret == extent_protocol::OK) {
+            eraseExtent(it);
+        } else {
+            it->second.pinned = false;
+        }
+    }
+    if (!pinned.empty()) {
+        pthread_cond_broadcast(&unpinCond);
+    }
+    for (auto &op : ops) {
+        if (ret == extent_protocol::OK || std::find(pinned.begin(), pinned.end(), op.id) == pinned.end()) {
+            changed(op.id);
+        } else {
+            remoteChanges++;
+        }
     }
 
+    for (auto &op : ops) {
+        if (ret == extent_protocol::OK && op.type == extent_protocol::compound_op::PUT && op.data.empty()) {
+            cached_extent &ce = pin(op.id);
+            ce.toDelete = false;
+            ce.attr.size = 0;
+            ce.attr.atime = ce.attr.mtime = ce.attr.ctime = std::time(nullptr);
+            unpin(ce);
+        }
+    }
+    trim();
     pthread_mutex_unlock(&mapLock);
     return ret;
 }
 
+extent_client::cache_stats
+extent_client::stats() {
+    pthread_mutex_lock(&mapLock);
+    cache_stats s = counters;
+    pthread_mutex_unlock(&mapLock);
+    return s;
+}
 
+void
+extent_client::printStats() {
+    pthread_mutex_lock(&mapLock);
+    cache_stats s = counters;
+    size_t cached = cachedBytes, dirty = dirtyBytes;
+    pthread_mutex_unlock(&mapLock);
+
+    printf("CACHE STATS: hits %llu misses %llu evictions %llu writebacks %llu prefetches %llu cached %zu dirty %zu "
+           "budget %zu\n", s.hits, s.misses, s.evictions, s.writebacks, s.prefetches, cached, dirty, cacheBudget);
+}
@@ -4,19 +4,234 @@
 #define extent_client_h
 
 #include <string>
+#include <list>
+#include <map>
+#include <set>
+#include <utility>
+#include <sys/uio.h>
 #include "extent_protocol.h"
 #include "rpc.h"
 
+// takes the data of a read as pieces of the cached pages, which stay in
+// place until consume returns
+class extent_reader {
+public:
+    virtual ~extent_reader() {}
+
+    virtual void consume(const struct iovec *iov, int count) = 0;
+};
+
+// tells whether this client holds the lock of an extent. the attributes of
+// an extent may only be cached while it does
+class extent_locks {
+public:
+    virtual ~extent_locks() {}
+
+    virtual bool held(extent_protocol::extentid_t eid) = 0;
+};
+
+// The client caches extents page by page. Every page keeps a bitmap of the
+// chunks that hold current data and of the chunks that were modified
+// locally, so a partial write only has to fetch the page when it cuts into
+// a chunk that is not known yet, and a flush only ships modified chunks.
+// All pages sit on one CLOCK ring and are evicted (after writing them back
+// if they are dirty) once the cache grows past its byte budget. Extents
+// without pages count against the budget too and are flushed and dropped
+// when evicting pages is not enough.
+//
+// A background writer keeps the share of dirty pages low, so that eviction
+// on the request path usually finds clean pages it can simply drop, and
+// writes back what stays dirty for long, so that a revoke rarely has to
+// wait for write RPCs. The write RPCs of a flush or of the writer go out
+// in parallel through a small pool of threads.
+//
+// Prefetches are loaded by another background thread, into extents that
+// are still cached only: an extent leaves the cache when its lock is
+// revoked, and nothing may be cached of it until the lock comes back.
+//
+// RPCs are sent without holding mapLock, so requests on different extents
+// overlap. A thread that sends one pins the extent first; other threads
+// wait for a pinned extent, and eviction and the background writer skip it.
 class extent_client {
+public:
+    static const unsigned int pagesize = extent_protocol::blocksize;
+    static const unsigned int chunksize = pagesize / 64;
+    static const size_t default_cache_bytes = 64 << 20;
+    // most pages a single write back RPC carries
+    static const unsigned int writeback_pages = 64;
+    // threads of the write back pool, and most runs one caller has in it
+    static const unsigned int writeback_threads = 4;
+    static const unsigned int writeback_window = 2 * writeback_threads;
+    // the background writer takes pages dirty for this many seconds, and
+    // the extents they belong to, up to this many at a time
+    static const unsigned int writeback_age = 1;
+    static const unsigned int writeback_extents = 16;
+
+    // hits and misses count page and attribute lookups, evictions count
+    // dropped pages and extents, writebacks count write RPCs, prefetches
+    // count the ranges loaded ahead of reads
+    struct cache_stats {
+        unsigned long long hits;
+        unsigned long long misses;
+        unsigned long long evictions;
+        unsigned long long writebacks;
+        unsigned long long prefetches;
+    };
+
 private:
+    typedef std::pair<extent_protocol::extentid_t, unsigned int> page_key;
+
+    struct page {
+        std::string data;          // pagesize bytes, unknown chunks are zero
+        unsigned long long valid;  // chunks holding current data
+        unsigned long long dirty;  // chunks modified since the last write back
+        time_t dirtied;            // when it last became dirty
+        bool referenced;
+        std::list<page_key>::iterator ring;
+    };
+
+    struct cached_extent {
+        extent_protocol::attr attr;
+        bool pinned = false;
+        bool toDelete = false;
+        // what the server holds, and the size changes that still have to
+        // reach it before the dirty pages can be written back
+        unsigned long long remoteSize = 0;
+        bool createPending = false;
+        bool truncatePending = false;
+        unsigned long long truncateTo = 0;
+        std::map<unsigned int, page> pages;
+    };
+
+    // what an extent entry costs on top of its pages
+    static const size_t entrysize = sizeof(cached_extent) + 64;
+
     rpcc *cl;
     pthread_mutex_t mapLock;
-    std::map <extent_protocol::extentid_t, std::string> files;
-    std::map <extent_protocol::extentid_t, extent_protocol::attr> attributes;
-    std::map<extent_protocol::extentid_t, bool> isDirty;
-    std::map<extent_protocol::extentid_t, bool> toDelete;
+    pthread_cond_t unpinCond;
+    std::map<extent_protocol::extentid_t, cached_extent> cache;
+
+    std::list<page_key> ring;
+    std::list<page_key>::iterator hand;
+    extent_protocol::extentid_t extentHand;
+    size_t cachedBytes;
+    size_t cacheBudget;
+
+    // dirty pages in (extent, page) order, so write back runs sequentially
+    std::set<page_key> dirtyPages;
+    size_t dirtyBytes;
+    pthread_cond_t writebackCond;
+
+    // dirty chunks that go back in one write RPC: the chunks [from, to) of
+    // every page, ending at the end of all but the last page
+    struct writeback_run {
+        struct piece {
+            unsigned int pageno;
+            page *pg;
+            unsigned int from;
+            unsigned int to;
+        };
+
+        extent_protocol::extentid_t eid;
+        cached_extent *ce;
+        std::vector<piece> pieces;
+        unsigned long long off;
+        std::string data;
+        extent_protocol::status ret;
+        bool done;
+    };
+    std::list<writeback_run *> writebackQueue;
+    pthread_cond_t writebackQueueCond;
+    pthread_cond_t writebackDoneCond;
+
+    struct prefetch_range {
+        extent_protocol::extentid_t eid;
+        unsigned long long off;
+        unsigned int len;
+    };
+    std::list<prefetch_range> prefetchQueue;
+    pthread_cond_t prefetchCond;
+
+    cache_stats counters;
+
+    // see changed
+    unsigned long long remoteChanges;
+
+    template<class... Args>
+    extent_protocol::status call(unsigned int proc, Args &&... args) {
+        pthread_mutex_unlock(&mapLock);
+        extent_protocol::status ret = cl->call(proc, std::forward<Args>(args)...);
+        pthread_mutex_lock(&mapLock);
+        return ret;
+    }
+
+    extent_protocol::status lookup(extent_protocol::extentid_t eid, cached_extent *&ce, unsigned long long off = 0,
+                                   unsigned int len = 0);
+
+    cached_extent &insertExtent(extent_protocol::extentid_t eid);
+
+    cached_extent &pin(extent_protocol::extentid_t eid);
+
+    void unpin(cached_extent &ce);
+
+    void eraseExtent(std::map<extent_protocol::extentid_t, cached_extent>::iterator it);
+
+    static unsigned long long remoteVisible(const cached_extent &ce);
+
+    page &insertPage(extent_protocol::extentid_t eid, cached_extent &ce, unsigned int pageno);
+
+    void dropPage(cached_extent &ce, std::map<unsigned int, page>::iterator it);
+
+    void dropPages(cached_extent &ce, unsigned int from);
+
+    void setDirty(const page_key &key, page &pg, unsigned long long dirty);
+
+    void storePages(extent_protocol::extentid_t eid, cached_extent &ce, unsigned int first, unsigned int last,
+                    const std::string &remote);
+
+    extent_protocol::status loadPages(extent_protocol::extentid_t eid, cached_extent &ce,
+                                      unsigned int first, unsigned int last);
+
+    void copyOut(cached_extent &ce, unsigned long long off, unsigned int len, std::string &buf);
+
+    void copyIn(extent_protocol::extentid_t eid, cached_extent &ce, unsigned long long off,
+                const char *data, size_t len);
+
+    extent_protocol::status writebackPending(extent_protocol::extentid_t eid, cached_extent &ce);
+
+    void collectRuns(extent_protocol::extentid_t eid, cached_extent &ce, unsigned int first, unsigned int last,
+                     std::vector<writeback_run> &runs);
+
+    void runData(writeback_run &run);
+
+    void runDone(writeback_run &run);
+
+    extent_protocol::status writeRuns(std::vector<writeback_run> &runs);
+
+    extent_protocol::status writebackPage(extent_protocol::extentid_t eid, cached_extent &ce, unsigned int pageno);
+
+    extent_protocol::status writebackExtent(extent_protocol::extentid_t eid, cached_extent &ce);
+
+    void evict(size_t target);
+
+    void evictExtents(size_t target);
+
+    void trim();
+
+    void uncache(extent_protocol::extentid_t eid);
+
+    void discard(extent_protocol::extentid_t eid);
+
+    void changed(extent_protocol::extentid_t eid);
+
 public:
-    extent_client(std::string dst);
+    extent_client(std::string dst, size_t cacheBytes = default_cache_bytes);
+
+    void writebacker();
+
+    void writeSender();
+
+    void prefetcher();
 
     extent_protocol::status get(extent_protocol::extentid_t eid, std::string &buf);
 
@@ -26,8 +241,51 @@ public:
 
     extent_protocol::status remove(extent_protocol::extentid_t eid);
 
+    extent_protocol::status read(extent_protocol::extentid_t eid, unsigned long long off, unsigned int len,
+                                 std::string &buf);
+
+    // reader is called once, with the extent pinned, unless the read fails
+    extent_protocol::status read(extent_protocol::extentid_t eid, unsigned long long off, unsigned int len,
+                                 extent_reader &reader);
+
+    // load [off, off + len) into the cache in the background
+    void prefetch(extent_protocol::extentid_t eid, unsigned long long off, unsigned int len);
+
+    // fetch the attributes of those of ids that are not cached and whose
+    // locks are held, in one round trip
+    void prefetchAttrs(const std::vector<extent_protocol::extentid_t> &ids, extent_locks &locks);
+
+    extent_protocol::status write(extent_protocol::extentid_t eid, unsigned long long off, const std::string &data);
+
+    extent_protocol::status write(extent_protocol::extentid_t eid, unsigned long long off, const char *data,
+                                  size_t len);
+
+    extent_protocol::status truncate(extent_protocol::extentid_t eid, unsigned long long size);
+
     extent_protocol::status flush(extent_protocol::extentid_t eid);
+
+    // directories are read and changed on the server, one entry at a time
+    extent_protocol::status dir_lookup(extent_protocol::extentid_t eid, const std::string &name,
+                                       unsigned long long &inum);
+
+    extent_protocol::status dir_add(extent_protocol::extentid_t eid, const std::string &name, unsigned long long inum);
+
+    extent_protocol::status dir_remove(extent_protocol::extentid_t eid, const std::string &name);
+
+    extent_protocol::status dir_list(extent_protocol::extentid_t eid, unsigned long long cursor, unsigned int count,
+                                     extent_protocol::dirlist &list);
+
+    // leases count fresh inode numbers, starting at first
+    extent_protocol::status alloc(unsigned int count, unsigned long long &first);
+
+    // several changes in one round trip, applied by the server all or none.
+    // the caller holds the locks of every extent they touch
+    extent_protocol::status compound(const std::vector<extent_protocol::compound_op> &ops);
+
+    cache_stats stats();
+
+    void printStats();
 };
 
-#endif 
+#endif
 
@@ -4,21 +4,37 @@
 #define extent_protocol_h
 
 #include "rpc.h"
+#include "dir_format.h"
 
 class extent_protocol {
 public:
     typedef int status;
     typedef unsigned long long extentid_t;
     enum xxstatus {
-        OK, RPCERR, NOENT, IOERR, FBIG
+        OK, RPCERR, NOENT, IOERR, FBIG, EXIST, STALE
     };
     enum rpc_numbers {
         put = 0x6001,
         get,
         getattr,
-        remove
+        remove,
+        read,
+        write,
+        truncate,
+        dir_lookup,
+        dir_add,
+        dir_remove,
+        dir_list,
+        alloc,
+        compound,
+        get_with_attr,
+        getattrs
     };
     static const unsigned int maxextent = 8192 * 1000;
+    // extents are stored as a map of fixed-size blocks on the server
+    static const unsigned int blocksize = 4096;
+    // alloc leases out inode numbers from here on; 1 is the root
+    static const extentid_t first_inum = 2;
 
     struct attr {
         unsigned int atime;
@@ -26,6 +42,38 @@ public:
         unsigned int ctime;
         unsigned int size;
     };
+
+    // the reply of get_with_attr: the attributes and the bytes of the range
+    // asked for, clipped to the end of the extent
+    struct attr_data {
+        attr a;
+        std::string data;
+    };
+
+    // the attributes of one extent of a getattrs batch, if ret is OK
+    struct attr_status {
+        status ret;
+        attr a;
+    };
+
+    // one batch of a directory listing, see dir_format::list
+    struct dirlist {
+        std::vector<dir_entry> entries;
+        std::vector<unsigned long long> cursors;
+    };
+
+    // one change of a compound call. put uses id and data, remove id,
+    // dir_add id, name and inum, dir_remove id and name
+    struct compound_op {
+        enum {
+            PUT = 1, REMOVE, DIR_ADD, DIR_REMOVE
+        };
+        int type;
+        extentid_t id;
+        std::string name;
+        unsigned long long inum;
+        std::string data;
+    };
 };
 
 inline unmarshall &
@@ -46,4 +94,73 @@ operator<<(marshall &m, extent_protocol::attr a) {
     return m;
 }
 
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::attr_data &d) {
+    u >> d.a;
+    u >> d.data;
+    return u;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::attr_status &s) {
+    u >> s.ret;
+    u >> s.a;
+    return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::attr_status &s) {
+    m << s.ret;
+    m << s.a;
+    return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, dir_entry &e) {
+    u >> e.name;
+    u >> e.inum;
+    return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const dir_entry &e) {
+    m << e.name;
+    m << e.inum;
+    return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::compound_op &o) {
+    u >> o.type;
+    u >> o.id;
+    u >> o.name;
+    u >> o.inum;
+    u >> o.data;
+    return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::compound_op &o) {
+    m << o.type;
+    m << o.id;
+    m << o.name;
+    m << o.inum;
+    m << o.data;
+    return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::dirlist &l) {
+    u >> l.entries;
+    u >> l.cursors;
+    return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::dirlist &l) {
+    m << l.entries;
+    m << l.cursors;
+    return m;
+}
+
 #endif 
@@ -7,71 +7,287 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <map>
-#include <ctime>
+#include <assert.h>
+#include <string.h>
+#include <set>
 
-extent_server::extent_server() {
-    pthread_mutex_init(&mapLock, NULL);
+// directory operations see the store through this. dir_format does all its
+// reading before it writes, so the writes are collected and applied to the
+// store as one change at the end
+class store_dir_io : public dir_io {
+    extent_store &store;
+    extent_protocol::extentid_t dir;
+    std::vector<extent_store::write_op> writes;
+    std::string image;
+    bool replaced;
+
+public:
+    extent_protocol::status ret;
+
+    store_dir_io(extent_store &store, extent_protocol::extentid_t dir)
+            : store(store), dir(dir), replaced(false), ret(extent_protocol::OK) {}
+
+    bool read(unsigned long long off, unsigned int len, std::string &buf) {
+        mapped_data d;
+        if ((ret = store.read(dir, off, len, d)) != extent_protocol::OK) {
+            return false;
+        }
+        buf = d.str();
+        return true;
+    }
+
+    bool write(unsigned long long off, const std::string &data) {
+        extent_store::write_op op = {off, data};
+        writes.push_back(op);
+        return true;
+    }
+
+    bool put(const std::string &data) {
+        image = data;
+        replaced = true;
+        writes.clear();
+        return true;
+    }
+
+    extent_protocol::status apply() {
+        if (replaced) {
+            ret = store.put(dir, image);
+        } else if (!writes.empty()) {
+            ret = store.write(dir, writes);
+        }
+        return ret;
+    }
+
+    // the collected writes as a change for a batch; false if there are none
+    bool change(extent_store::change &c) {
+        c.id = dir;
+        if (replaced) {
+            c.type = extent_store::change::PUT;
+            c.data = image;
+        } else {
+            c.type = extent_store::change::WRITE;
+            c.writes = writes;
+        }
+        return replaced || !writes.empty();
+    }
+};
+
+// a failed read leaves the store's status behind, so a missing directory
+// comes back as NOENT rather than IOERR
+static int
+dirStatus(dir_format::status r, store_dir_io &io) {
+    switch (r) {
+        case dir_format::OK:
+            return extent_protocol::OK;
+        case dir_format::NOENT:
+            return extent_protocol::NOENT;
+        case dir_format::EXIST:
+            return extent_protocol::EXIST;
+        case dir_format::STALE:
+            return extent_protocol::STALE;
+        default:
+            return io.ret != extent_protocol::OK ? io.ret : extent_protocol::IOERR;
+    }
+}
+
+extent_server::extent_server(std::string dir, size_t segmentBytes)
+        : store(dir, segmentBytes) {
+    for (unsigned int i = 0; i < ndirlocks; i++) {
+        assert(pthread_rwlock_init(&dirLocks[i], NULL) == 0);
+    }
+
+    pthread_mutex_init(&allocLock, NULL);
+    allocNext = extent_protocol::first_inum;
+    mapped_data d;
+    if (store.get(alloc_extent, d) == extent_protocol::OK) {
+        std::string next = d.str();
+        assert(next.size() == sizeof(allocNext));
+        memcpy(&allocNext, next.data(), sizeof(allocNext));
+    }
+}
+
+pthread_rwlock_t *
+extent_server::dirLock(extent_protocol::extentid_t id) {
+    return &dirLocks[id % ndirlocks];
 }
 
 int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &) {
-    pthread_mutex_lock(&mapLock);
-
-    files[id] = buf;
-    extent_protocol::attr newAttr;
-    newAttr.size = buf.size();
-    time_t currTime = std::time(nullptr);
-    newAttr.atime = currTime;
-    newAttr.mtime = currTime;
-    newAttr.ctime = currTime;
-    attributes[id] = newAttr;
-
-    pthread_mutex_unlock(&mapLock);
-    return extent_protocol::OK;
+    return store.put(id, buf);
 }
 
-int extent_server::get(extent_protocol::extentid_t id, std::string &buf) {
-    pthread_mutex_lock(&mapLock);
+int extent_server::get(extent_protocol::extentid_t id, mapped_data &buf) {
+    return store.get(id, buf);
+}
 
-    try {
-        attributes.at(id).atime = std::time(nullptr);
-        buf = files.at(id);
+int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a) {
+    return store.getattr(id, a);
+}
 
-        pthread_mutex_unlock(&mapLock);
-        return extent_protocol::OK;
-    } catch (const std::out_of_range &oor) {
-        pthread_mutex_unlock(&mapLock);
-        return extent_protocol::NOENT;
+int extent_server::remove(extent_protocol::extentid_t id, int &) {
+    return store.remove(id);
+}
+
+int extent_server::read(extent_protocol::extentid_t id, unsigned long long off, unsigned int len, mapped_data &buf) {
+    return store.read(id, off, len, buf);
+}
+
+int extent_server::get_with_attr(extent_protocol::extentid_t id, unsigned long long off, unsigned int len,
+                                 mapped_attr_data &r) {
+    return store.read(id, off, len, r.data, &r.a);
+}
+
+int extent_server::getattrs(std::vector<extent_protocol::extentid_t> ids,
+                            std::vector<extent_protocol::attr_status> &attrs) {
+    attrs.resize(ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+        attrs[i].ret = store.getattr(ids[i], attrs[i].a);
     }
+    return extent_protocol::OK;
 }
 
-int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a) {
-    pthread_mutex_lock(&mapLock);
+int extent_server::write(extent_protocol::extentid_t id, unsigned long long off, std::string data, int &) {
+    return store.write(id, off, data);
+}
+
+int extent_server::truncate(extent_protocol::extentid_t id, unsigned long long size, int &) {
+    return store.truncate(id, size);
+}
 
-    try {
-        a = attributes.at(id);
+int extent_server::dir_lookup(extent_protocol::extentid_t id, std::string name, unsigned long long &inum) {
+    pthread_rwlock_rdlock(dirLock(id));
+    store_dir_io io(store, id);
+    int r = dirStatus(dir_format(io).lookup(name, inum), io);
+    pthread_rwlock_unlock(dirLock(id));
+    return r;
+}
 
-        pthread_mutex_unlock(&mapLock);
-        return extent_protocol::OK;
-    } catch (const std::out_of_range &oor) {
-        pthread_mutex_unlock(&mapLock);
-        return extent_protocol::NOENT;
+int extent_server::dir_add(extent_protocol::extentid_t id, std::string name, unsigned long long inum, int &) {
+    pthread_rwlock_wrlock(dirLock(id));
+    store_dir_io io(store, id);
+    int r = dirStatus(dir_format(io).add(name, inum), io);
+    if (r == extent_protocol::OK) {
+        r = io.apply();
     }
+    pthread_rwlock_unlock(dirLock(id));
+    return r;
 }
 
-int extent_server::remove(extent_protocol::extentid_t id, int &) {
-    pthread_mutex_lock(&mapLock);
+int extent_server::dir_remove(extent_protocol::extentid_t id, std::string name, int &) {
+    pthread_rwlock_wrlock(dirLock(id));
+    store_dir_io io(store, id);
+    int r = dirStatus(dir_format(io).remove(name), io);
+    if (r == extent_protocol::OK) {
+        r = io.apply();
+    }
+    pthread_rwlock_unlock(dirLock(id));
+    return r;
+}
+
+int extent_server::dir_list(extent_protocol::extentid_t id, unsigned long long cursor, unsigned int count,
+                            extent_protocol::dirlist &list) {
+    pthread_rwlock_rdlock(dirLock(id));
+    store_dir_io io(store, id);
+    int r = dirStatus(dir_format(io).list(cursor, count, list.entries, list.cursors), io);
+    pthread_rwlock_unlock(dirLock(id));
+    return r;
+}
 
-    auto file_it = files.find(id);
-    if (file_it != files.end()) {
-        files.erase(file_it);
+int extent_server::alloc(unsigned int count, unsigned long long &first) {
+    // bit 63 is left to yfs_client, which marks files with it
+    if (count == 0 || count > max_lease) {
+        return extent_protocol::IOERR;
     }
-    auto attr_it = attributes.find(id);
-    if (attr_it != attributes.end()) {
-        attributes.erase(attr_it);
+
+    pthread_mutex_lock(&allocLock);
+    unsigned long long next = allocNext + count;
+    int r = extent_protocol::FBIG;
+    if (next <= 1ULL << 63) {
+        r = store.put(alloc_extent, std::string((const char *) &next, sizeof(next)));
+    }
+    if (r == extent_protocol::OK) {
+        first = allocNext;
+        allocNext = next;
     }
+    pthread_mutex_unlock(&allocLock);
+    return r;
+}
 
-    pthread_mutex_unlock(&mapLock);
-    return extent_protocol::OK;
+// turn one op of a compound call into the change of the store it makes;
+// any is false if it changes nothing. assumes the directories it reads are
+// locked
+int extent_server::prepare(const extent_protocol::compound_op &op, extent_store::change &c, bool &any) {
+    int r = extent_protocol::OK;
+    any = true;
+    c.id = op.id;
+
+    switch (op.type) {
+        case extent_protocol::compound_op::PUT:
+            c.type = extent_store::change::PUT;
+            c.data = op.data;
+            break;
+        case extent_protocol::compound_op::REMOVE:
+            c.type = extent_store::change::REMOVE;
+            break;
+        case extent_protocol::compound_op::DIR_ADD: {
+            store_dir_io io(store, op.id);
+            if ((r = dirStatus(dir_format(io).add(op.name, op.inum), io)) == extent_protocol::OK) {
+                any = io.change(c);
+            }
+            break;
+        }
+        case extent_protocol::compound_op::DIR_REMOVE: {
+            store_dir_io io(store, op.id);
+            if ((r = dirStatus(dir_format(io).remove(op.name), io)) == extent_protocol::OK) {
+                any = io.change(c);
+            }
+            break;
+        }
+        default:
+            r = extent_protocol::IOERR;
+    }
+    return r;
 }
 
+int extent_server::compound(std::vector<extent_protocol::compound_op> ops, unsigned int &failed) {
+    // the directories stay locked for the whole call, so no other directory
+    // operation sees it half done. stripes are taken in order
+    std::set<unsigned int> stripes;
+    for (auto &op : ops) {
+        if (op.type == extent_protocol::compound_op::DIR_ADD || op.type == extent_protocol::compound_op::DIR_REMOVE) {
+            stripes.insert(op.id % ndirlocks);
+        }
+    }
+    for (unsigned int s : stripes) {
+        pthread_rwlock_wrlock(&dirLocks[s]);
+    }
+
+    // every op is checked and turned into a change before any is made; the
+    // store then logs them as one change, which survives a crash whole or
+    // not at all. each op reads the store as it was before the call, so a
+    // compound touches every extent at most once
+    std::vector<extent_store::change> changes;
+    std::vector<unsigned int> from;
+    int r = extent_protocol::OK;
+    failed = ops.size();
+    for (size_t i = 0; i < ops.size() && r == extent_protocol::OK; i++) {
+        extent_store::change c;
+        bool any;
+        if ((r = prepare(ops[i], c, any)) != extent_protocol::OK) {
+            failed = i;
+        } else if (any) {
+            changes.push_back(c);
+            from.push_back(i);
+        }
+    }
+    if (r == extent_protocol::OK) {
+        size_t bad;
+        if ((r = store.batch(changes, bad)) != extent_protocol::OK) {
+            failed = bad < from.size() ? from[bad] : ops.size();
+        }
+    }
+
+    for (unsigned int s : stripes) {
+        pthread_rwlock_unlock(&dirLocks[s]);
+    }
+    return r;
+}
@@ -6,28 +6,67 @@
 #include <string>
 #include <map>
 #include "extent_protocol.h"
+#include "extent_store.h"
 
 class extent_server {
-    pthread_mutex_t mapLock;
-    std::map <extent_protocol::extentid_t, std::string> files;
-    std::map <extent_protocol::extentid_t, extent_protocol::attr> attributes;
+    // an extent is a sparse map of fixed-size blocks. blocks that were never
+    // written (holes) read back as zeroes, so a write only touches the blocks
+    // covering its byte range. the blocks live in a log on disk.
+    extent_store store;
+
+    // a directory operation reads its directory piece by piece and may then
+    // write it; no other directory operation may change it in between
+    static const unsigned int ndirlocks = 16;
+    pthread_rwlock_t dirLocks[ndirlocks];
+
+    pthread_rwlock_t *dirLock(extent_protocol::extentid_t id);
+
+    // the next inode number to lease out. it is kept in the reserved
+    // extent 0, and every lease is on disk before it is handed out
+    static const extent_protocol::extentid_t alloc_extent = 0;
+    static const unsigned int max_lease = 1 << 20;
+    pthread_mutex_t allocLock;
+    unsigned long long allocNext;
+
+    int prepare(const extent_protocol::compound_op &op, extent_store::change &c, bool &any);
+
 public:
-    extent_server();
+    extent_server(std::string dir, size_t segmentBytes = extent_store::default_segment_bytes);
 
     int put(extent_protocol::extentid_t id, std::string, int &);
 
-    int get(extent_protocol::extentid_t id, std::string &);
+    int get(extent_protocol::extentid_t id, mapped_data &);
 
     int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
 
     int remove(extent_protocol::extentid_t id, int &);
-};
 
-#endif 
+    int read(extent_protocol::extentid_t id, unsigned long long off, unsigned int len, mapped_data &);
 
+    // the attributes and a range in one round trip
+    int get_with_attr(extent_protocol::extentid_t id, unsigned long long off, unsigned int len, mapped_attr_data &);
 
+    int getattrs(std::vector<extent_protocol::extentid_t> ids, std::vector<extent_protocol::attr_status> &attrs);
 
+    int write(extent_protocol::extentid_t id, unsigned long long off, std::string data, int &);
 
+    int truncate(extent_protocol::extentid_t id, unsigned long long size, int &);
 
+    int dir_lookup(extent_protocol::extentid_t id, std::string name, unsigned long long &inum);
 
+    int dir_add(extent_protocol::extentid_t id, std::string name, unsigned long long inum, int &);
+
+    int dir_remove(extent_protocol::extentid_t id, std::string name, int &);
+
+    int dir_list(extent_protocol::extentid_t id, unsigned long long cursor, unsigned int count,
+                 extent_protocol::dirlist &list);
+
+    // leases the inode numbers [first, first + count) to the caller
+    int alloc(unsigned int count, unsigned long long &first);
+
+    // applies ops as one change, all or none, also across a crash. each
+    // extent may appear once. if an op fails, failed is its index
+    int compound(std::vector<extent_protocol::compound_op> ops, unsigned int &failed);
+};
 
+#endif
@@ -10,8 +10,8 @@ int
 main(int argc, char *argv[]) {
     int count = 0;
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s port\n", argv[0]);
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s port [directory]\n", argv[0]);
         exit(1);
     }
 
@@ -22,13 +22,33 @@ main(int argc, char *argv[]) {
         count = atoi(count_env);
     }
 
+    // extents are kept in a log under the given directory,
+    // extent-<port> by default
+    std::string dir = argc == 3 ? argv[2] : std::string("extent-") + argv[1];
+    size_t segmentBytes = extent_store::default_segment_bytes;
+    char *segment_env = getenv("EXTENT_SEGMENT_KB");
+    if (segment_env != NULL && atoi(segment_env) > 0) {
+        segmentBytes = (size_t) atoi(segment_env) << 10;
+    }
+
+    extent_server ls(dir, segmentBytes);
     rpcs server(atoi(argv[1]), count);
-    extent_server ls;
 
     server.reg(extent_protocol::get, &ls, &extent_server::get);
     server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
     server.reg(extent_protocol::put, &ls, &extent_server::put);
     server.reg(extent_protocol::remove, &ls, &extent_server::remove);
+    server.reg(extent_protocol::read, &ls, &extent_server::read);
+    server.reg(extent_protocol::write, &ls, &extent_server::write);
+    server.reg(extent_protocol::truncate, &ls, &extent_server::truncate);
+    server.reg(extent_protocol::dir_lookup, &ls, &extent_server::dir_lookup);
+    server.reg(extent_protocol::dir_add, &ls, &extent_server::dir_add);
+    server.reg(extent_protocol::dir_remove, &ls, &extent_server::dir_remove);
+    server.reg(extent_protocol::dir_list, &ls, &extent_server::dir_list);
+    server.reg(extent_protocol::alloc, &ls, &extent_server::alloc);
+    server.reg(extent_protocol::compound, &ls, &extent_server::compound);
+    server.reg(extent_protocol::get_with_attr, &ls, &extent_server::get_with_attr);
+    server.reg(extent_protocol::getattrs, &ls, &extent_server::getattrs);
 
     while (1)
         sleep(1000);
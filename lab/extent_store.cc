@@ -0,0 +1,1141 @@
+// log-structured extent storage
+
+#include "extent_store.h"
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <climits>
+#include <algorithm>
+#include <set>
+#include <ctime>
+
+static const uint32_t RECORD_MAGIC = 0x7966736c;  // "yfsl"
+static const uint32_t FOOTER_MAGIC = 0x79667366;  // "yfsf"
+
+static uint32_t crcTable[256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+static void
+initCrc() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        crcTable[i] = c;
+    }
+}
+
+static uint32_t
+crc32(uint32_t crc, const char *p, size_t n) {
+    crc = ~crc;
+    while (n-- > 0) {
+        crc = crcTable[(crc ^ (uint8_t) *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+template<class H>
+static uint32_t
+recordCrc(const H &h, const char *payload, size_t len) {
+    // the crc covers everything after the magic and the crc itself
+    size_t skip = 2 * sizeof(uint32_t);
+    return crc32(crc32(0, (const char *) &h + skip, sizeof(h) - skip), payload, len);
+}
+
+static void *
+compactthread(void *x) {
+    extent_store *es = (extent_store *) x;
+    es->compacter();
+    return 0;
+}
+
+segment_map::segment_map(int fd, size_t _len)
+        : base(NULL), len(0) {
+    void *p = fd < 0 || _len == 0 ? MAP_FAILED : mmap(NULL, _len, PROT_READ, MAP_SHARED, fd, 0);
+    if (p != MAP_FAILED) {
+        base = (const char *) p;
+        len = _len;
+    }
+}
+
+segment_map::~segment_map() {
+    if (base != NULL) {
+        munmap((void *) base, len);
+    }
+}
+
+void
+mapped_data::append(const std::shared_ptr<segment_map> &m, const char *p, unsigned int len) {
+    if (pins.empty() || pins.back() != m) {
+        pins.push_back(m);
+    }
+    if (!pieces.empty() && pieces.back().p != NULL && pieces.back().p + pieces.back().len == p) {
+        pieces.back().len += len;
+    } else {
+        piece pc = {p, len};
+        pieces.push_back(pc);
+    }
+    size += len;
+}
+
+void
+mapped_data::appendZeroes(unsigned int len) {
+    if (len == 0) {
+        return;
+    }
+    if (!pieces.empty() && pieces.back().p == NULL) {
+        pieces.back().len += len;
+    } else {
+        piece pc = {NULL, len};
+        pieces.push_back(pc);
+    }
+    size += len;
+}
+
+std::string
+mapped_data::str() const {
+    std::string s;
+    s.reserve(size);
+    for (auto &pc : pieces) {
+        if (pc.p != NULL) {
+            s.append(pc.p, pc.len);
+        } else {
+            s.append(pc.len, '\0');
+        }
+    }
+    return s;
+}
+
+marshall &
+operator<<(marshall &m, const mapped_data &d) {
+    static const char zeroes[extent_protocol::blocksize] = {0};
+
+    m.reserve(sizeof(unsigned int) + d.size);
+    m << d.size;
+    for (auto &pc : d.pieces) {
+        if (pc.p != NULL) {
+            m.rawbytes(pc.p, pc.len);
+            continue;
+        }
+        for (unsigned int done = 0; done < pc.len;) {
+            unsigned int n = std::min(pc.len - done, (unsigned int) sizeof(zeroes));
+            m.rawbytes(zeroes, n);
+            done += n;
+        }
+    }
+    return m;
+}
+
+extent_store::extent_store(std::string _dir, size_t _segmentBytes)
+        : dir(_dir), segmentBytes(_segmentBytes), active(0), nextLsn(1), syncing(false), syncedLsn(0) {
+    pthread_once(&crcOnce, initCrc);
+    for (unsigned int i = 0; i < nshards; i++) {
+        pthread_rwlock_init(&shards[i].lock, NULL);
+    }
+    pthread_mutex_init(&logLock, NULL);
+    pthread_rwlock_init(&segLock, NULL);
+    pthread_cond_init(&syncCond, NULL);
+
+    recover();
+
+    pthread_t th;
+    int r = pthread_create(&th, NULL, &compactthread, (void *) this);
+    assert(r == 0);
+}
+
+std::string
+extent_store::segmentPath(uint32_t seg) {
+    char name[32];
+    snprintf(name, sizeof(name), "/seg-%08u", seg);
+    return dir + name;
+}
+
+// make creating and unlinking segments durable
+void
+extent_store::syncDir() {
+    int fd = open(dir.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+void
+extent_store::openSegment(uint32_t seg) {
+    int fd = open(segmentPath(seg).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("extent_store: open segment");
+        assert(0);
+    }
+
+    pthread_rwlock_wrlock(&segLock);
+    segment &s = segments[seg];
+    pthread_rwlock_unlock(&segLock);
+
+    // the active segment is mapped as far as it can grow
+    s.fd = fd;
+    s.map = std::make_shared<segment_map>(fd, segmentBytes);
+    s.size = 0;
+    s.minLsn = UINT64_MAX;
+    s.maxLsn = 0;
+    s.liveBytes = 0;
+    s.sealed = false;
+    syncDir();
+}
+
+std::shared_ptr<segment_map>
+extent_store::segmentMap(uint32_t seg) {
+    pthread_rwlock_rdlock(&segLock);
+    std::shared_ptr<segment_map> m = segments.at(seg).map;
+    pthread_rwlock_unlock(&segLock);
+    return m;
+}
+
+extent_store::shard &
+extent_store::shardOf(extent_protocol::extentid_t id) {
+    return shards[((id * 0x9e3779b97f4a7c15ULL) >> 32) % nshards];
+}
+
+// readers share the shard lock and only touch the access time, so it is
+// accessed atomically
+extent_protocol::attr
+extent_store::readAttr(stored_extent &e) {
+    extent_protocol::attr a;
+    a.atime = __atomic_load_n(&e.attr.atime, __ATOMIC_RELAXED);
+    a.mtime = e.attr.mtime;
+    a.ctime = e.attr.ctime;
+    a.size = e.attr.size;
+    return a;
+}
+
+void
+extent_store::touch(stored_extent &e) {
+    __atomic_store_n(&e.attr.atime, (unsigned int) std::time(nullptr), __ATOMIC_RELAXED);
+}
+
+// append the footer and force the segment to disk. assumes logLock is
+// held, or that nobody else knows the segment yet
+void
+extent_store::sealSegment(segment &s) {
+    segment_trailer t;
+    t.minLsn = s.minLsn;
+    t.maxLsn = s.maxLsn;
+    t.count = s.entries.size();
+    t.crc = crc32(0, (const char *) s.entries.data(), s.entries.size() * sizeof(footer_entry));
+    t.footerOffset = s.size;
+    t.magic = FOOTER_MAGIC;
+
+    std::string buf((const char *) s.entries.data(), s.entries.size() * sizeof(footer_entry));
+    buf.append((const char *) &t, sizeof(t));
+    if (pwrite(s.fd, buf.data(), buf.size(), s.size) != (ssize_t) buf.size() || fsync(s.fd) != 0) {
+        perror("extent_store: seal segment");
+        assert(0);
+    }
+
+    s.size += buf.size();
+    s.sealed = true;
+    std::vector<footer_entry>().swap(s.entries);
+}
+
+// a duplicate of the active segment's descriptor, for syncing without
+// logLock: rollover may close the original meanwhile. assumes logLock is held
+int
+extent_store::dupActive() {
+    int fd = dup(segments.at(active).fd);
+    if (fd < 0) {
+        perror("extent_store: dup segment");
+        assert(0);
+    }
+    return fd;
+}
+
+// seal the active segment and start the next one. sealing synced every
+// record appended so far. assumes logLock is held
+void
+extent_store::rollover() {
+    segment &s = segments[active];
+    sealSegment(s);
+    close(s.fd);
+    s.fd = -1;
+    syncedLsn = nextLsn - 1;
+    pthread_cond_broadcast(&syncCond);
+
+    active = segments.rbegin()->first + 1;
+    openSegment(active);
+}
+
+bool
+extent_store::loadFooter(int fd, off_t fileSize, segment_trailer &t, std::vector<footer_entry> &entries) {
+    if (fileSize < (off_t) sizeof(t) ||
+        pread(fd, &t, sizeof(t), fileSize - sizeof(t)) != (ssize_t) sizeof(t) ||
+        t.magic != FOOTER_MAGIC ||
+        (off_t) t.footerOffset + (off_t) (t.count * sizeof(footer_entry)) + (off_t) sizeof(t) != fileSize) {
+        return false;
+    }
+
+    entries.resize(t.count);
+    size_t bytes = t.count * sizeof(footer_entry);
+    return pread(fd, entries.data(), bytes, t.footerOffset) == (ssize_t) bytes &&
+           crc32(0, (const char *) entries.data(), bytes) == t.crc;
+}
+
+// collect the records of a segment that was not sealed, up to the last
+// change all of whose records are intact; the records of a change torn by
+// the crash are dropped together. returns where the valid part ends
+uint32_t
+extent_store::scanSegment(int fd, off_t fileSize, std::vector<footer_entry> &entries) {
+    std::string buf(fileSize, '\0');
+    if (pread(fd, &buf[0], fileSize, 0) != fileSize) {
+        return 0;
+    }
+
+    size_t pos = 0;
+    size_t complete = 0;
+    size_t count = entries.size();
+    while (pos + sizeof(record_header) <= buf.size()) {
+        footer_entry fe;
+        memcpy(&fe.h, buf.data() + pos, sizeof(record_header));
+        size_t end = pos + sizeof(record_header) + fe.h.len;
+        if (fe.h.magic != RECORD_MAGIC || end > buf.size() ||
+            recordCrc(fe.h, buf.data() + pos + sizeof(record_header), fe.h.len) != fe.h.crc) {
+            break;
+        }
+        fe.offset = pos;
+        fe.pad = 0;
+        entries.push_back(fe);
+        pos = end;
+        if (fe.h.flags & BATCH_END) {
+            complete = pos;
+            count = entries.size();
+        }
+    }
+    entries.resize(count);
+    return complete;
+}
+
+struct replay_entry {
+    uint64_t lsn;
+    uint32_t seg;
+    size_t pos;
+};
+
+static bool
+byLsn(const replay_entry &a, const replay_entry &b) {
+    return a.lsn < b.lsn;
+}
+
+// rebuild the index from the footers of all segments. a segment without a
+// valid footer was active at a crash: it is scanned, cut after its last
+// complete change and sealed.
+void
+extent_store::recover() {
+    mkdir(dir.c_str(), 0755);
+
+    std::vector<uint32_t> ids;
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL) {
+        perror("extent_store: open directory");
+        assert(0);
+    }
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        uint32_t seg;
+        char c;
+        if (sscanf(de->d_name, "seg-%u%c", &seg, &c) == 1) {
+            ids.push_back(seg);
+        }
+    }
+    closedir(d);
+    std::sort(ids.begin(), ids.end());
+
+    std::map<uint32_t, std::vector<footer_entry> > footers;
+    size_t scanned = 0;
+
+    for (uint32_t seg : ids) {
+        int fd = open(segmentPath(seg).c_str(), O_RDWR);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            perror("extent_store: open segment");
+            assert(0);
+        }
+
+        segment_trailer t;
+        std::vector<footer_entry> &entries = footers[seg];
+        segment &s = segments[seg];
+        s.fd = fd;
+        s.liveBytes = 0;
+        s.sealed = true;
+
+        if (loadFooter(fd, st.st_size, t, entries)) {
+            s.size = st.st_size;
+            s.minLsn = t.minLsn;
+            s.maxLsn = t.maxLsn;
+            s.map = std::make_shared<segment_map>(fd, s.size);
+            close(fd);
+            s.fd = -1;
+            continue;
+        }
+
+        scanned++;
+        entries.clear();
+        s.size = scanSegment(fd, st.st_size, entries);
+        if (entries.empty()) {
+            close(fd);
+            unlink(segmentPath(seg).c_str());
+            segments.erase(seg);
+            footers.erase(seg);
+            continue;
+        }
+
+        if (ftruncate(fd, s.size) != 0) {
+            perror("extent_store: truncate segment");
+        }
+        s.minLsn = UINT64_MAX;
+        s.maxLsn = 0;
+        for (auto &fe : entries) {
+            s.minLsn = std::min(s.minLsn, (uint64_t) fe.h.lsn);
+            s.maxLsn = std::max(s.maxLsn, (uint64_t) fe.h.lsn);
+        }
+        s.entries = entries;
+        sealSegment(s);
+        s.map = std::make_shared<segment_map>(fd, s.size);
+        close(fd);
+        s.fd = -1;
+    }
+
+    // records of one extent may be spread over any segments, so they are
+    // applied in LSN order
+    std::vector<replay_entry> all;
+    for (auto &f : footers) {
+        for (size_t i = 0; i < f.second.size(); i++) {
+            replay_entry r = {f.second[i].h.lsn, f.first, i};
+            all.push_back(r);
+        }
+    }
+    std::stable_sort(all.begin(), all.end(), byLsn);
+
+    for (auto &r : all) {
+        apply(r.seg, footers[r.seg][r.pos]);
+        nextLsn = std::max(nextLsn, r.lsn + 1);
+    }
+    syncedLsn = nextLsn - 1;
+
+    active = segments.empty() ? 0 : segments.rbegin()->first + 1;
+    openSegment(active);
+
+    size_t extents = 0;
+    for (unsigned int i = 0; i < nshards; i++) {
+        extents += shards[i].index.size();
+    }
+    printf("extent_store: %zu extents in %zu segments (%zu scanned), next lsn %llu\n",
+           extents, segments.size() - 1, scanned, (unsigned long long) nextLsn);
+}
+
+extent_store::record
+extent_store::blockRecord(extent_protocol::extentid_t id, unsigned int blockno, const std::string &data) {
+    record r;
+    memset(&r.fe, 0, sizeof(r.fe));
+    r.fe.h.type = BLOCK;
+    r.fe.h.id = id;
+    r.fe.h.arg = blockno;
+    r.payload = data;
+    return r;
+}
+
+extent_store::record
+extent_store::attrRecord(extent_protocol::extentid_t id, const extent_protocol::attr &a) {
+    record r;
+    memset(&r.fe, 0, sizeof(r.fe));
+    r.fe.h.type = ATTR;
+    r.fe.h.id = id;
+    r.fe.h.arg = a.size;
+    r.fe.h.atime = a.atime;
+    r.fe.h.mtime = a.mtime;
+    r.fe.h.ctime = a.ctime;
+    return r;
+}
+
+extent_store::record
+extent_store::killRecord(record_type type, extent_protocol::extentid_t id, unsigned long long size) {
+    record r;
+    memset(&r.fe, 0, sizeof(r.fe));
+    r.fe.h.type = type;
+    r.fe.h.id = id;
+    r.fe.h.arg = size;
+    return r;
+}
+
+// write the records to the end of the log with a single write, filling in
+// their LSN (unless they keep the one they have), crc and offset. they form
+// one change, which recovery replays whole or not at all. returns the
+// segment they went to. assumes logLock is held
+uint32_t
+extent_store::append(std::vector<record> &recs, bool newLsn) {
+    size_t bytes = 0;
+    for (auto &r : recs) {
+        bytes += sizeof(record_header) + r.payload.size();
+    }
+    if (segments.at(active).size > 0 && segments.at(active).size + bytes > segmentBytes) {
+        rollover();
+    }
+
+    segment &s = segments.at(active);
+    std::string buf;
+    buf.reserve(bytes);
+
+    for (auto &r : recs) {
+        record_header &h = r.fe.h;
+        h.magic = RECORD_MAGIC;
+        if (newLsn) {
+            h.lsn = nextLsn++;
+        }
+        h.len = r.payload.size();
+        h.flags = &r == &recs.back() ? BATCH_END : 0;
+        h.crc = recordCrc(h, r.payload.data(), r.payload.size());
+        r.fe.offset = s.size + buf.size();
+
+        buf.append((const char *) &h, sizeof(h));
+        buf.append(r.payload);
+
+        s.entries.push_back(r.fe);
+        s.minLsn = std::min(s.minLsn, (uint64_t) h.lsn);
+        s.maxLsn = std::max(s.maxLsn, (uint64_t) h.lsn);
+    }
+
+    if (pwrite(s.fd, buf.data(), buf.size(), s.size) != (ssize_t) buf.size()) {
+        perror("extent_store: append");
+        assert(0);
+    }
+    s.size += buf.size();
+    // only a single oversized change can outgrow the mapping
+    if (s.map->len < s.size) {
+        std::shared_ptr<segment_map> m = std::make_shared<segment_map>(s.fd, s.size + segmentBytes);
+        pthread_rwlock_wrlock(&segLock);
+        s.map = m;
+        pthread_rwlock_unlock(&segLock);
+    }
+    return active;
+}
+
+// the index no longer needs the record behind l. assumes logLock is held
+void
+extent_store::release(const location &l) {
+    auto it = segments.find(l.seg);
+    if (it != segments.end()) {
+        it->second.liveBytes -= sizeof(record_header) + l.stored;
+    }
+}
+
+// replay one record against the index. this is the only place the index
+// changes, both on the request path and on recovery. assumes the shard of
+// the extent is write-locked and logLock is held
+void
+extent_store::apply(uint32_t seg, const footer_entry &fe) {
+    const unsigned int bs = extent_protocol::blocksize;
+    const record_header &h = fe.h;
+    extent_table<stored_extent> &index = shardOf(h.id).index;
+    location l = {seg, fe.offset, h.len, h.len, h.lsn};
+
+    // kill records never become garbage on their own; compaction decides
+    // when they can go
+    segments.at(seg).liveBytes += sizeof(record_header) + h.len;
+
+    switch (h.type) {
+        case BLOCK: {
+            stored_extent &e = index[h.id];
+            auto res = e.blocks.insert(std::make_pair((unsigned int) h.arg, l));
+            if (!res.second) {
+                release(res.first->second);
+                res.first->second = l;
+            }
+            break;
+        }
+        case ATTR: {
+            auto res = index.insert(h.id);
+            stored_extent &e = *res.first;
+            if (!res.second && e.attrLoc.lsn != 0) {
+                release(e.attrLoc);
+            }
+            e.attr.atime = h.atime;
+            e.attr.mtime = h.mtime;
+            e.attr.ctime = h.ctime;
+            e.attr.size = h.arg;
+            e.attrLoc = l;
+            break;
+        }
+        case TRUNC: {
+            stored_extent *e = index.find(h.id);
+            if (e == NULL) {
+                break;
+            }
+            std::map<unsigned int, location> &blocks = e->blocks;
+
+            // drop every block past the new end and cut the block it falls into
+            auto b = blocks.lower_bound((h.arg + bs - 1) / bs);
+            while (b != blocks.end()) {
+                release(b->second);
+                blocks.erase(b++);
+            }
+            if (h.arg % bs != 0) {
+                auto last = blocks.find(h.arg / bs);
+                if (last != blocks.end()) {
+                    last->second.len = std::min(last->second.len, (uint32_t) (h.arg % bs));
+                }
+            }
+            break;
+        }
+        case REMOVE: {
+            stored_extent *e = index.find(h.id);
+            if (e == NULL) {
+                break;
+            }
+            for (auto &b : e->blocks) {
+                release(b.second);
+            }
+            if (e->attrLoc.lsn != 0) {
+                release(e->attrLoc);
+            }
+            index.erase(h.id);
+            break;
+        }
+        default:
+            printf("extent_store: unknown record type %u\n", h.type);
+            assert(0);
+    }
+}
+
+// append the records and apply them. returns the LSN to wait for.
+// assumes the shards of their extents are write-locked
+uint64_t
+extent_store::logRecords(std::vector<record> &recs) {
+    pthread_mutex_lock(&logLock);
+    uint32_t seg = append(recs, true);
+    for (auto &r : recs) {
+        apply(seg, r.fe);
+    }
+    pthread_mutex_unlock(&logLock);
+    return recs.back().fe.h.lsn;
+}
+
+bool
+extent_store::readBlock(const location &l, std::string &buf) {
+    std::shared_ptr<segment_map> m = segmentMap(l.seg);
+    size_t start = l.offset + sizeof(record_header);
+    if (m->base == NULL || start + l.len > m->len) {
+        return false;
+    }
+    buf.assign(m->base + start, l.len);
+    return true;
+}
+
+// describe [off, off + len) of the extent as pieces of the mapped segments.
+// holes and the gap between a short block and the block size are zeroes.
+// assumes the shard of the extent is locked
+bool
+extent_store::readRange(const stored_extent &e, unsigned long long off, unsigned int len, mapped_data &buf) {
+    const unsigned int bs = extent_protocol::blocksize;
+
+    buf = mapped_data();
+    if (len == 0) {
+        return true;
+    }
+
+    auto it = e.blocks.lower_bound(off / bs);
+    auto end = e.blocks.upper_bound((off + len - 1) / bs);
+    unsigned long long pos = off;
+    std::shared_ptr<segment_map> m;
+    uint32_t mapped = 0;
+
+    for (; it != end; it++) {
+        const location &l = it->second;
+        unsigned long long blockStart = (unsigned long long) it->first * bs;
+        unsigned long long from = std::max(off, blockStart);
+        unsigned long long to = std::min(off + len, blockStart + l.len);
+        if (from >= to) {
+            continue;
+        }
+
+        if (!m || mapped != l.seg) {
+            m = segmentMap(l.seg);
+            mapped = l.seg;
+        }
+        size_t start = l.offset + sizeof(record_header) + (from - blockStart);
+        if (m->base == NULL || start + (to - from) > m->len) {
+            return false;
+        }
+        buf.appendZeroes(from - pos);
+        buf.append(m, m->base + start, to - from);
+        pos = to;
+    }
+    buf.appendZeroes(off + len - pos);
+    return true;
+}
+
+// wait until the log is on disk up to lsn. whoever finds no sync in flight
+// syncs everything appended so far; the others wait for that sync, so a
+// burst of writers pays for one fdatasync
+void
+extent_store::commit(uint64_t lsn) {
+    pthread_mutex_lock(&logLock);
+    while (syncedLsn < lsn) {
+        if (syncing) {
+            pthread_cond_wait(&syncCond, &logLock);
+            continue;
+        }
+
+        syncing = true;
+        uint64_t target = nextLsn - 1;
+        int fd = dupActive();
+
+        pthread_mutex_unlock(&logLock);
+        if (fdatasync(fd) != 0) {
+            perror("extent_store: sync");
+            assert(0);
+        }
+        close(fd);
+        pthread_mutex_lock(&logLock);
+
+        syncedLsn = std::max(syncedLsn, target);
+        syncing = false;
+        pthread_cond_broadcast(&syncCond);
+    }
+    pthread_mutex_unlock(&logLock);
+}
+
+// whether compacting seg has to keep a record. data and attribute records
+// are kept while the index points at them. a kill record is kept while any
+// other segment might still hold an older record it hides.
+// assumes the shard of the extent is locked and logLock is held
+bool
+extent_store::isLive(uint32_t seg, const footer_entry &fe) {
+    const record_header &h = fe.h;
+
+    if (h.type == TRUNC || h.type == REMOVE) {
+        for (auto &s : segments) {
+            if (s.first != seg && s.second.minLsn < h.lsn) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    extent_table<stored_extent> &index = shardOf(h.id).index;
+    const stored_extent *e = index.find(h.id);
+    if (e == NULL) {
+        return false;
+    }
+    const location *l = &e->attrLoc;
+    if (h.type == BLOCK) {
+        auto b = e->blocks.find(h.arg);
+        if (b == e->blocks.end()) {
+            return false;
+        }
+        l = &b->second;
+    }
+    return l->lsn == h.lsn && l->seg == seg && l->offset == fe.offset;
+}
+
+// copy the live records of a sealed segment to the end of the log and
+// delete it. the locks are taken per record so requests keep going
+void
+extent_store::compact(uint32_t seg) {
+    segment_trailer t;
+    std::vector<footer_entry> entries;
+
+    int sfd = open(segmentPath(seg).c_str(), O_RDONLY);
+    struct stat st;
+    bool ok = sfd >= 0 && fstat(sfd, &st) == 0 && loadFooter(sfd, st.st_size, t, entries);
+    if (sfd >= 0) {
+        close(sfd);
+    }
+    if (!ok) {
+        return;
+    }
+
+    size_t copied = 0;
+    for (auto &fe : entries) {
+        shard &sh = shardOf(fe.h.id);
+        pthread_rwlock_wrlock(&sh.lock);
+        pthread_mutex_lock(&logLock);
+
+        if (!isLive(seg, fe)) {
+            pthread_mutex_unlock(&logLock);
+            pthread_rwlock_unlock(&sh.lock);
+            continue;
+        }
+
+        std::vector<record> recs(1);
+        record &r = recs[0];
+        r.fe = fe;
+        location *l = NULL;
+
+        if (fe.h.type == BLOCK) {
+            // only what is left after truncates is copied
+            l = &sh.index[fe.h.id].blocks[fe.h.arg];
+            if (!readBlock(*l, r.payload)) {
+                pthread_mutex_unlock(&logLock);
+                pthread_rwlock_unlock(&sh.lock);
+                printf("extent_store: cannot read segment %u, not compacting it\n", seg);
+                return;
+            }
+        } else if (fe.h.type == ATTR) {
+            stored_extent &e = sh.index[fe.h.id];
+            r = attrRecord(fe.h.id, e.attr);
+            r.fe.h.lsn = fe.h.lsn;
+            l = &e.attrLoc;
+        }
+
+        uint32_t to = append(recs, false);
+        segments.at(to).liveBytes += sizeof(record_header) + r.payload.size();
+        if (l != NULL) {
+            release(*l);
+            l->seg = to;
+            l->offset = r.fe.offset;
+            l->stored = r.payload.size();
+        }
+        copied++;
+
+        pthread_mutex_unlock(&logLock);
+        pthread_rwlock_unlock(&sh.lock);
+    }
+
+    // the copies have to be on disk before the originals go away
+    pthread_mutex_lock(&logLock);
+    int fd = dupActive();
+    pthread_mutex_unlock(&logLock);
+    if (fdatasync(fd) != 0) {
+        perror("extent_store: sync");
+        assert(0);
+    }
+    close(fd);
+
+    pthread_mutex_lock(&logLock);
+    unlink(segmentPath(seg).c_str());
+    pthread_rwlock_wrlock(&segLock);
+    segments.erase(seg);
+    pthread_rwlock_unlock(&segLock);
+    pthread_mutex_unlock(&logLock);
+    syncDir();
+
+    printf("extent_store: compacted segment %u, kept %zu of %zu records\n", seg, copied, entries.size());
+}
+
+// compact sealed segments once more than half of them is garbage
+void
+extent_store::compacter() {
+    while (1) {
+        sleep(5);
+
+        std::vector<uint32_t> victims;
+        pthread_mutex_lock(&logLock);
+        for (auto &s : segments) {
+            if (s.second.sealed && s.second.liveBytes * 2 < s.second.size) {
+                victims.push_back(s.first);
+            }
+        }
+        pthread_mutex_unlock(&logLock);
+
+        for (uint32_t seg : victims) {
+            compact(seg);
+        }
+    }
+}
+
+// the records that replace the extent by buf. assumes the shard of the
+// extent is write-locked, as do the other record builders
+void
+extent_store::putRecords(extent_protocol::extentid_t id, const std::string &buf, std::vector<record> &recs) {
+    const unsigned int bs = extent_protocol::blocksize;
+
+    if (shardOf(id).index.find(id) != NULL) {
+        recs.push_back(killRecord(TRUNC, id, 0));
+    }
+    for (size_t done = 0; done < buf.size(); done += bs) {
+        recs.push_back(blockRecord(id, done / bs, buf.substr(done, bs)));
+    }
+
+    extent_protocol::attr a;
+    a.size = buf.size();
+    a.atime = a.mtime = a.ctime = std::time(nullptr);
+    recs.push_back(attrRecord(id, a));
+}
+
+extent_protocol::status
+extent_store::put(extent_protocol::extentid_t id, const std::string &buf) {
+    std::vector<record> recs;
+
+    shard &sh = shardOf(id);
+    pthread_rwlock_wrlock(&sh.lock);
+
+    putRecords(id, buf, recs);
+    uint64_t lsn = logRecords(recs);
+
+    pthread_rwlock_unlock(&sh.lock);
+    commit(lsn);
+    return extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_store::get(extent_protocol::extentid_t id, mapped_data &buf) {
+    shard &sh = shardOf(id);
+    pthread_rwlock_rdlock(&sh.lock);
+
+    stored_extent *e = sh.index.find(id);
+    if (e == NULL) {
+        pthread_rwlock_unlock(&sh.lock);
+        return extent_protocol::NOENT;
+    }
+
+    // access times are only kept in memory; they reach the log with the
+    // next change of the extent
+    touch(*e);
+    bool ok = readRange(*e, 0, e->attr.size, buf);
+
+    pthread_rwlock_unlock(&sh.lock);
+    return ok ? extent_protocol::OK : extent_protocol::IOERR;
+}
+
+extent_protocol::status
+extent_store::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a) {
+    shard &sh = shardOf(id);
+    pthread_rwlock_rdlock(&sh.lock);
+
+    stored_extent *e = sh.index.find(id);
+    if (e == NULL) {
+        pthread_rwlock_unlock(&sh.lock);
+        return extent_protocol::NOENT;
+    }
+    a = readAttr(*e);
+
+    pthread_rwlock_unlock(&sh.lock);
+    return extent_protocol::OK;
+}
+
+// a missing extent needs no record
+void
+extent_store::removeRecords(extent_protocol::extentid_t id, std::vector<record> &recs) {
+    if (shardOf(id).index.find(id) != NULL) {
+        recs.push_back(killRecord(REMOVE, id, 0));
+    }
+}
+
+extent_protocol::status
+extent_store::remove(extent_protocol::extentid_t id) {
+    shard &sh = shardOf(id);
+    pthread_rwlock_wrlock(&sh.lock);
+
+    std::vector<record> recs;
+    removeRecords(id, recs);
+    if (recs.empty()) {
+        pthread_rwlock_unlock(&sh.lock);
+        return extent_protocol::OK;
+    }
+    uint64_t lsn = logRecords(recs);
+
+    pthread_rwlock_unlock(&sh.lock);
+    commit(lsn);
+    return extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_store::read(extent_protocol::extentid_t id, unsigned long long off, unsigned int len, mapped_data &buf,
+                   extent_protocol::attr *a) {
+    shard &sh = shardOf(id);
+    pthread_rwlock_rdlock(&sh.lock);
+
+    stored_extent *e = sh.index.find(id);
+    if (e == NULL) {
+        pthread_rwlock_unlock(&sh.lock);
+        return extent_protocol::NOENT;
+    }
+
+    touch(*e);
+
+    // reads are clipped to the end of the extent
+    if (off >= e->attr.size) {
+        len = 0;
+    } else if (off + len > e->attr.size) {
+        len = e->attr.size - off;
+    }
+    bool ok = readRange(*e, off, len, buf);
+    if (a != NULL) {
+        *a = e->attr;
+    }
+
+    pthread_rwlock_unlock(&sh.lock);
+    return ok ? extent_protocol::OK : extent_protocol::IOERR;
+}
+
+extent_protocol::status
+extent_store::write(extent_protocol::extentid_t id, unsigned long long off, const std::string &data) {
+    std::vector<write_op> ops(1);
+    ops[0].off = off;
+    ops[0].data = data;
+    return write(id, ops);
+}
+
+extent_protocol::status
+extent_store::writeRecords(extent_protocol::extentid_t id, const std::vector<write_op> &ops,
+                           std::vector<record> &recs) {
+    const unsigned int bs = extent_protocol::blocksize;
+
+    for (auto &op : ops) {
+        if (op.off + op.data.size() > UINT_MAX) {
+            return extent_protocol::FBIG;
+        }
+    }
+
+    stored_extent *e = shardOf(id).index.find(id);
+    if (e == NULL) {
+        return extent_protocol::NOENT;
+    }
+
+    // every touched block is logged whole and once, merged with what it
+    // held before
+    std::map<unsigned int, std::string> touched;
+    extent_protocol::attr a = e->attr;
+
+    for (auto &op : ops) {
+        size_t done = 0;
+        while (done < op.data.size()) {
+            unsigned long long pos = op.off + done;
+            unsigned int blockOff = pos % bs;
+            size_t n = std::min((size_t) (bs - blockOff), op.data.size() - done);
+
+            auto t = touched.find(pos / bs);
+            if (t == touched.end()) {
+                t = touched.insert(std::make_pair((unsigned int) (pos / bs), std::string())).first;
+                auto b = e->blocks.find(pos / bs);
+                if (b != e->blocks.end() && (blockOff > 0 || n < b->second.len) && !readBlock(b->second, t->second)) {
+                    return extent_protocol::IOERR;
+                }
+            }
+            std::string &block = t->second;
+            if (block.size() < blockOff + n) {
+                block.resize(blockOff + n);
+            }
+            block.replace(blockOff, n, op.data, done, n);
+
+            done += n;
+        }
+        if (op.off + op.data.size() > a.size) {
+            a.size = op.off + op.data.size();
+        }
+    }
+
+    for (auto &t : touched) {
+        recs.push_back(blockRecord(id, t.first, t.second));
+    }
+    a.mtime = a.ctime = std::time(nullptr);
+    recs.push_back(attrRecord(id, a));
+    return extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_store::write(extent_protocol::extentid_t id, const std::vector<write_op> &ops) {
+    shard &sh = shardOf(id);
+    pthread_rwlock_wrlock(&sh.lock);
+
+    std::vector<record> recs;
+    extent_protocol::status r = writeRecords(id, ops, recs);
+    if (r != extent_protocol::OK) {
+        pthread_rwlock_unlock(&sh.lock);
+        return r;
+    }
+    uint64_t lsn = logRecords(recs);
+
+    pthread_rwlock_unlock(&sh.lock);
+    commit(lsn);
+    return extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_store::truncate(extent_protocol::extentid_t id, unsigned long long size) {
+    if (size > UINT_MAX) {
+        return extent_protocol::FBIG;
+    }
+
+    shard &sh = shardOf(id);
+    pthread_rwlock_wrlock(&sh.lock);
+
+    stored_extent *e = sh.index.find(id);
+    if (e == NULL) {
+        pthread_rwlock_unlock(&sh.lock);
+        return extent_protocol::NOENT;
+    }
+
+    extent_protocol::attr a = e->attr;
+    a.size = size;
+    a.mtime = a.ctime = std::time(nullptr);
+
+    std::vector<record> recs;
+    recs.push_back(killRecord(TRUNC, id, size));
+    recs.push_back(attrRecord(id, a));
+    uint64_t lsn = logRecords(recs);
+
+    pthread_rwlock_unlock(&sh.lock);
+    commit(lsn);
+    return extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_store::batch(const std::vector<change> &changes, size_t &failed) {
+    failed = changes.size();
+
+    // the shards are locked in order, as no other path takes more than one
+    std::set<extent_protocol::extentid_t> ids;
+    std::set<unsigned int> locked;
+    for (size_t i = 0; i < changes.size(); i++) {
+        if (!ids.insert(changes[i].id).second) {
+            failed = i;
+            return extent_protocol::IOERR;
+        }
+        locked.insert(&shardOf(changes[i].id) - shards);
+    }
+    for (unsigned int i : locked) {
+        pthread_rwlock_wrlock(&shards[i].lock);
+    }
+
+    std::vector<record> recs;
+    extent_protocol::status r = extent_protocol::OK;
+    for (size_t i = 0; i < changes.size() && r == extent_protocol::OK; i++) {
+        const change &c = changes[i];
+        switch (c.type) {
+            case change::PUT:
+                putRecords(c.id, c.data, recs);
+                break;
+            case change::REMOVE:
+                removeRecords(c.id, recs);
+                break;
+            case change::WRITE:
+                r = writeRecords(c.id, c.writes, recs);
+                break;
+            default:
+                r = extent_protocol::IOERR;
+        }
+        if (r != extent_protocol::OK) {
+            failed = i;
+        }
+    }
+
+    // one append is one change to recovery, so all of them are replayed
+    // or none
+    uint64_t lsn = 0;
+    if (r == extent_protocol::OK && !recs.empty()) {
+        lsn = logRecords(recs);
+    }
+    for (unsigned int i : locked) {
+        pthread_rwlock_unlock(&shards[i].lock);
+    }
+    if (lsn != 0) {
+        commit(lsn);
+    }
+    return r;
+}
@@ -0,0 +1,287 @@
+// durable extent storage for the extent server
+
+#ifndef extent_store_h
+#define extent_store_h
+
+#include <string>
+#include <map>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+#include <pthread.h>
+#include "extent_protocol.h"
+#include "extent_table.h"
+
+// read-only mapping of a segment file. replies keep the mapping alive until
+// they are marshalled, so a segment can be compacted away under them.
+class segment_map {
+public:
+    const char *base;
+    size_t len;
+
+    segment_map(int fd, size_t len);
+
+    ~segment_map();
+};
+
+// the bytes of a get or read reply, as pieces of mapped segments and runs
+// of zeroes. it marshals exactly like a std::string, so the mapped pages are
+// copied once, straight into the reply, and clients unmarshall a string.
+struct mapped_data {
+    struct piece {
+        const char *p;      // NULL for zeroes
+        unsigned int len;
+    };
+
+    unsigned int size;
+    std::vector<piece> pieces;
+    std::vector<std::shared_ptr<segment_map> > pins;
+
+    mapped_data() : size(0) {}
+
+    void append(const std::shared_ptr<segment_map> &m, const char *p, unsigned int len);
+
+    void appendZeroes(unsigned int len);
+
+    // the bytes as one string, for callers inside the server
+    std::string str() const;
+};
+
+marshall &operator<<(marshall &m, const mapped_data &d);
+
+// a get_with_attr reply; marshals like extent_protocol::attr_data
+struct mapped_attr_data {
+    extent_protocol::attr a;
+    mapped_data data;
+};
+
+inline marshall &
+operator<<(marshall &m, const mapped_attr_data &d) {
+    m << d.a;
+    m << d.data;
+    return m;
+}
+
+// The store is an append-only log of records, cut into segment files in one
+// directory, plus an in-memory index that points at the records that are
+// still current. Every change appends records and updates the index; the
+// caller's reply waits until the records are on disk, and concurrent
+// callers share one fdatasync (group commit).
+//
+// Records carry a global log sequence number, and replaying them in LSN
+// order rebuilds the index no matter which segment they sit in. A full
+// segment is sealed with a footer that repeats every record header, so
+// startup reads footers only and scans just the segment that was active
+// at a crash. A background thread compacts sealed segments that are mostly
+// garbage by copying their live records, with their original LSN, to the
+// end of the log.
+//
+// The index is split into shards by extent id, each behind a reader-writer
+// lock, so requests for different extents and reads of the same extent run
+// in parallel. Only appending to the log is serialized.
+class extent_store {
+public:
+    static const size_t default_segment_bytes = 16 << 20;
+
+    // one write of a batch
+    struct write_op {
+        unsigned long long off;
+        std::string data;
+    };
+
+    // one change of an extent in a batch: put uses data, write writes
+    struct change {
+        enum {
+            PUT = 1, REMOVE, WRITE
+        };
+        int type;
+        extent_protocol::extentid_t id;
+        std::string data;
+        std::vector<write_op> writes;
+    };
+
+private:
+    static const unsigned int nshards = 16;
+
+    enum record_type {
+        BLOCK = 1,  // contents of one block
+        ATTR,       // the attributes after a change
+        TRUNC,      // drops every older block byte at or past the size
+        REMOVE      // drops every older record of the extent
+    };
+
+    struct record_header {
+        uint32_t magic;
+        uint32_t crc;       // over the rest of the header and the payload
+        uint64_t lsn;
+        uint64_t id;
+        uint64_t arg;       // block number, or the size for TRUNC and ATTR
+        uint32_t type;
+        uint32_t len;       // payload bytes, only BLOCK has a payload
+        uint32_t atime;
+        uint32_t mtime;
+        uint32_t ctime;
+        uint32_t flags;     // BATCH_END on the last record of a change
+    };
+
+    // a change is only replayed if its last record made it to disk
+    static const uint32_t BATCH_END = 1;
+
+    struct footer_entry {
+        uint32_t offset;    // of the record in its segment
+        uint32_t pad;
+        record_header h;
+    };
+
+    struct segment_trailer {
+        uint64_t minLsn;
+        uint64_t maxLsn;
+        uint32_t count;
+        uint32_t crc;       // over the footer entries
+        uint32_t footerOffset;
+        uint32_t magic;
+    };
+
+    struct segment {
+        int fd;             // only the active segment stays open
+        std::shared_ptr<segment_map> map;
+        uint32_t size;
+        uint64_t minLsn;
+        uint64_t maxLsn;
+        size_t liveBytes;   // records the index still needs
+        bool sealed;
+        std::vector<footer_entry> entries;  // only kept while active
+    };
+
+    struct record {
+        footer_entry fe;
+        std::string payload;
+    };
+
+    struct location {
+        uint32_t seg;
+        uint32_t offset;    // of the record header
+        uint32_t len;       // current bytes, a truncate may have cut the block
+        uint32_t stored;    // payload bytes of the record
+        uint64_t lsn;
+    };
+
+    struct stored_extent {
+        extent_protocol::attr attr;
+        location attrLoc;
+        std::map<unsigned int, location> blocks;
+    };
+
+    struct shard {
+        pthread_rwlock_t lock;
+        extent_table<stored_extent> index;
+    };
+
+    std::string dir;
+    size_t segmentBytes;
+
+    shard shards[nshards];
+
+    // logLock protects the end of the log, the live byte counts and the
+    // group commit state. changing the segment table also takes segLock,
+    // which readers take on their own to find a mapping. the lock order is
+    // shard, logLock, segLock
+    pthread_mutex_t logLock;
+    pthread_rwlock_t segLock;
+    std::map<uint32_t, segment> segments;
+    uint32_t active;
+    uint64_t nextLsn;
+
+    // group commit
+    pthread_cond_t syncCond;
+    bool syncing;
+    uint64_t syncedLsn;
+
+    std::string segmentPath(uint32_t seg);
+
+    void syncDir();
+
+    void openSegment(uint32_t seg);
+
+    std::shared_ptr<segment_map> segmentMap(uint32_t seg);
+
+    shard &shardOf(extent_protocol::extentid_t id);
+
+    static extent_protocol::attr readAttr(stored_extent &e);
+
+    static void touch(stored_extent &e);
+
+    void sealSegment(segment &s);
+
+    void rollover();
+
+    int dupActive();
+
+    static bool loadFooter(int fd, off_t fileSize, segment_trailer &t, std::vector<footer_entry> &entries);
+
+    static uint32_t scanSegment(int fd, off_t fileSize, std::vector<footer_entry> &entries);
+
+    void recover();
+
+    static record blockRecord(extent_protocol::extentid_t id, unsigned int blockno, const std::string &data);
+
+    static record attrRecord(extent_protocol::extentid_t id, const extent_protocol::attr &a);
+
+    static record killRecord(record_type type, extent_protocol::extentid_t id, unsigned long long size);
+
+    void putRecords(extent_protocol::extentid_t id, const std::string &buf, std::vector<record> &recs);
+
+    void removeRecords(extent_protocol::extentid_t id, std::vector<record> &recs);
+
+    extent_protocol::status writeRecords(extent_protocol::extentid_t id, const std::vector<write_op> &ops,
+                                         std::vector<record> &recs);
+
+    uint32_t append(std::vector<record> &recs, bool newLsn);
+
+    void apply(uint32_t seg, const footer_entry &fe);
+
+    uint64_t logRecords(std::vector<record> &recs);
+
+    void release(const location &l);
+
+    bool readBlock(const location &l, std::string &buf);
+
+    bool readRange(const stored_extent &e, unsigned long long off, unsigned int len, mapped_data &buf);
+
+    void commit(uint64_t lsn);
+
+    bool isLive(uint32_t seg, const footer_entry &fe);
+
+    void compact(uint32_t seg);
+
+public:
+    extent_store(std::string dir, size_t segmentBytes = default_segment_bytes);
+
+    void compacter();
+
+    extent_protocol::status put(extent_protocol::extentid_t id, const std::string &buf);
+
+    extent_protocol::status get(extent_protocol::extentid_t id, mapped_data &buf);
+
+    extent_protocol::status getattr(extent_protocol::extentid_t id, extent_protocol::attr &a);
+
+    extent_protocol::status remove(extent_protocol::extentid_t id);
+
+    // a, if given, gets the attributes the range was read at
+    extent_protocol::status read(extent_protocol::extentid_t id, unsigned long long off, unsigned int len,
+                                 mapped_data &buf, extent_protocol::attr *a = NULL);
+
+    extent_protocol::status write(extent_protocol::extentid_t id, unsigned long long off, const std::string &data);
+
+    // applies the writes in order as one change, logged and synced once
+    extent_protocol::status write(extent_protocol::extentid_t id, const std::vector<write_op> &ops);
+
+    extent_protocol::status truncate(extent_protocol::extentid_t id, unsigned long long size);
+
+    // applies changes of different extents as one: they are logged and
+    // synced together, and after a crash either all of them are there or
+    // none. if one fails, none is applied and failed is its index
+    extent_protocol::status batch(const std::vector<change> &changes, size_t &failed);
+};
+
+#endif
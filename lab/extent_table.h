@@ -0,0 +1,143 @@
+// flat hash table keyed by extent id
+
+#ifndef extent_table_h
+#define extent_table_h
+
+#include <vector>
+#include <utility>
+#include <stddef.h>
+#include <stdint.h>
+#include "extent_protocol.h"
+
+// Open addressing with linear probing over one array of slots, each holding
+// the key and the value inline, so a lookup is a hash and a short scan of
+// adjacent memory instead of a walk down a tree of separately allocated
+// nodes. Erasing shifts the following entries of the run back rather than
+// leaving tombstones, so probe runs stay short under churn.
+//
+// Pointers returned by find and insert are invalidated by the next insert
+// or erase.
+template<class V>
+class extent_table {
+    struct slot {
+        extent_protocol::extentid_t key;
+        bool used;
+        V value;
+
+        slot() : key(0), used(false) {}
+    };
+
+    std::vector<slot> slots;
+    size_t mask;
+    size_t count;
+
+    // extent ids are mostly small and sequential; mix them so neighbours
+    // spread out over the table
+    static size_t hash(extent_protocol::extentid_t key) {
+        uint64_t h = key;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    size_t probe(extent_protocol::extentid_t key) const {
+        size_t i = hash(key) & mask;
+        while (slots[i].used && slots[i].key != key) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    void grow() {
+        std::vector<slot> old;
+        old.swap(slots);
+        slots.resize(old.size() * 2);
+        mask = slots.size() - 1;
+        for (auto &s : old) {
+            if (s.used) {
+                slot &n = slots[probe(s.key)];
+                n.key = s.key;
+                n.used = true;
+                n.value = std::move(s.value);
+            }
+        }
+    }
+
+public:
+    explicit extent_table(size_t capacity = 16) : count(0) {
+        size_t n = 16;
+        while (n < capacity) {
+            n *= 2;
+        }
+        slots.resize(n);
+        mask = n - 1;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    V *find(extent_protocol::extentid_t key) {
+        slot &s = slots[probe(key)];
+        return s.used ? &s.value : NULL;
+    }
+
+    const V *find(extent_protocol::extentid_t key) const {
+        const slot &s = slots[probe(key)];
+        return s.used ? &s.value : NULL;
+    }
+
+    // returns the value for key and whether it was just default-constructed
+    std::pair<V *, bool> insert(extent_protocol::extentid_t key) {
+        size_t i = probe(key);
+        if (slots[i].used) {
+            return std::make_pair(&slots[i].value, false);
+        }
+        // keep the load factor under 3/4
+        if ((count + 1) * 4 > slots.size() * 3) {
+            grow();
+            i = probe(key);
+        }
+        slots[i].key = key;
+        slots[i].used = true;
+        count++;
+        return std::make_pair(&slots[i].value, true);
+    }
+
+    V &operator[](extent_protocol::extentid_t key) {
+        return *insert(key).first;
+    }
+
+    bool erase(extent_protocol::extentid_t key) {
+        size_t i = probe(key);
+        if (!slots[i].used) {
+            return false;
+        }
+
+        // move later entries of the run into the hole unless that would put
+        // them before their home slot
+        size_t j = i;
+        for (;;) {
+            j = (j + 1) & mask;
+            if (!slots[j].used) {
+                break;
+            }
+            size_t home = hash(slots[j].key) & mask;
+            bool between = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+            if (!between) {
+                slots[i].key = slots[j].key;
+                slots[i].value = std::move(slots[j].value);
+                i = j;
+            }
+        }
+        slots[i].used = false;
+        slots[i].value = V();
+        count--;
+        return true;
+    }
+};
+
+#endif
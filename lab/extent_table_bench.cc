@@ -0,0 +1,181 @@
+//
+// extent index micro-benchmark
+//
+// times inserts, lookups of present ids and lookups of absent ids for
+// three layouts of the extent server's index:
+//   two maps     separate std::maps for contents and attributes, as the
+//                original extent_server kept them
+//   one map      one std::map from id to an entry holding both
+//   flat table   extent_table, the open-addressing table the store uses
+// the default sizes are 1M and 10M extents.
+//
+
+#include "extent_table.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <map>
+#include <string>
+
+// roughly the shape of extent_store's stored_extent: the attributes, where
+// they are logged, and the map of blocks
+struct bench_entry {
+    extent_protocol::attr attr;
+    uint64_t attrLoc[3];
+    std::map<unsigned int, uint64_t> blocks;
+};
+
+static const size_t max_lookups = 2000000;
+
+static double
+now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+report(const char *layout, size_t n, const char *op, double secs, size_t ops) {
+    printf("%-10s %9zu extents  %-12s %8.1f ns/op\n", layout, n, op, secs * 1e9 / ops);
+}
+
+static void
+bench_two_maps(size_t n, const std::vector<uint64_t> &ids, const std::vector<uint64_t> &probes,
+               const std::vector<uint64_t> &absent) {
+    std::map<extent_protocol::extentid_t, std::string> *files =
+            new std::map<extent_protocol::extentid_t, std::string>;
+    std::map<extent_protocol::extentid_t, extent_protocol::attr> *attributes =
+            new std::map<extent_protocol::extentid_t, extent_protocol::attr>;
+    size_t found = 0;
+
+    double t = now();
+    for (size_t i = 0; i < n; i++) {
+        (*files)[ids[i]] = std::string();
+        (*attributes)[ids[i]].size = i;
+    }
+    report("two maps", n, "insert", now() - t, n);
+
+    t = now();
+    for (auto id : probes) {
+        auto f = files->find(id);
+        auto a = attributes->find(id);
+        found += f != files->end() && a != attributes->end() && a->second.size < n;
+    }
+    report("two maps", n, "lookup", now() - t, probes.size());
+    assert(found == probes.size());
+
+    t = now();
+    for (auto id : absent) {
+        found += files->find(id) != files->end();
+    }
+    report("two maps", n, "lookup miss", now() - t, absent.size());
+
+    delete files;
+    delete attributes;
+}
+
+static void
+bench_one_map(size_t n, const std::vector<uint64_t> &ids, const std::vector<uint64_t> &probes,
+              const std::vector<uint64_t> &absent) {
+    std::map<extent_protocol::extentid_t, bench_entry> *index =
+            new std::map<extent_protocol::extentid_t, bench_entry>;
+    size_t found = 0;
+
+    double t = now();
+    for (size_t i = 0; i < n; i++) {
+        (*index)[ids[i]].attr.size = i;
+    }
+    report("one map", n, "insert", now() - t, n);
+
+    t = now();
+    for (auto id : probes) {
+        auto it = index->find(id);
+        found += it != index->end() && it->second.attr.size < n;
+    }
+    report("one map", n, "lookup", now() - t, probes.size());
+    assert(found == probes.size());
+
+    t = now();
+    for (auto id : absent) {
+        found += index->find(id) != index->end();
+    }
+    report("one map", n, "lookup miss", now() - t, absent.size());
+
+    delete index;
+}
+
+static void
+bench_table(size_t n, const std::vector<uint64_t> &ids, const std::vector<uint64_t> &probes,
+            const std::vector<uint64_t> &absent) {
+    extent_table<bench_entry> *index = new extent_table<bench_entry>;
+    size_t found = 0;
+
+    double t = now();
+    for (size_t i = 0; i < n; i++) {
+        (*index)[ids[i]].attr.size = i;
+    }
+    report("flat table", n, "insert", now() - t, n);
+
+    t = now();
+    for (auto id : probes) {
+        bench_entry *e = index->find(id);
+        found += e != NULL && e->attr.size < n;
+    }
+    report("flat table", n, "lookup", now() - t, probes.size());
+    assert(found == probes.size());
+
+    t = now();
+    for (auto id : absent) {
+        found += index->find(id) != NULL;
+    }
+    report("flat table", n, "lookup miss", now() - t, absent.size());
+
+    // erasing shifts entries around; the rest must still be found
+    t = now();
+    for (size_t i = 0; i < n; i += 2) {
+        index->erase(ids[i]);
+    }
+    report("flat table", n, "erase", now() - t, (n + 1) / 2);
+    assert(index->size() == n / 2);
+    for (size_t i = 0; i < n; i++) {
+        assert((index->find(ids[i]) != NULL) == (i % 2 == 1));
+    }
+
+    delete index;
+}
+
+int
+main(int argc, char *argv[]) {
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    std::vector<size_t> sizes;
+    for (int i = 1; i < argc; i++) {
+        sizes.push_back(strtoul(argv[i], NULL, 10));
+    }
+    if (sizes.empty()) {
+        sizes.push_back(1000000);
+        sizes.push_back(10000000);
+    }
+
+    for (size_t n : sizes) {
+        unsigned int seed = n;
+        std::vector<uint64_t> ids(n), probes, absent;
+
+        // ids look like yfs inums: leased in order, with the file bit on
+        // for most
+        for (size_t i = 0; i < n; i++) {
+            ids[i] = (i + extent_protocol::first_inum) | ((uint64_t) (i % 8 != 0) << 63);
+        }
+        for (size_t i = 0; i < std::min(n, max_lookups); i++) {
+            probes.push_back(ids[rand_r(&seed) % n]);
+            absent.push_back(ids[rand_r(&seed) % n] ^ (1ULL << 63));
+        }
+
+        bench_two_maps(n, ids, probes, absent);
+        bench_one_map(n, ids, probes, absent);
+        bench_table(n, ids, probes, absent);
+    }
+    return 0;
+}
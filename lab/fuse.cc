@@ -16,11 +16,98 @@
 #include <unistd.h>
 #include <assert.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <set>
 #include "yfs_client.h"
 
 int myid;
 yfs_client *yfs;
 
+#if FUSE_VERSION >= 28
+static const double cache_timeout = 3600;
+// entries are not invalidated, see kernel_cache
+static const double entry_timeout = 1;
+#else
+// the kernel cannot be told to forget anything, so it may not keep anything
+static const double cache_timeout = 0;
+static const double entry_timeout = 0;
+#endif
+
+// The kernel may cache attributes for as long as this client holds the lock
+// they were read under, since no other client can change them before the
+// lock server takes the lock back. When it does, the kernel is told to
+// forget the inode's attributes before the lock goes back. A reply read
+// before any release may already be stale, so it goes out without a
+// timeout; one counter for all inodes keeps this check free of per-inode
+// state.
+//
+// Only attributes are invalidated: invalidating pages would wait for page
+// locks that a read holds while it waits for this very lock, and
+// invalidating an entry takes the directory's i_mutex, which the kernel
+// holds while a request in that directory waits for the lock. Entries
+// therefore just get a short timeout.
+class kernel_cache : public lock_release_user {
+    pthread_mutex_t m;
+    unsigned long long releases;
+    struct fuse_chan *ch;
+
+public:
+    kernel_cache() : releases(0), ch(NULL) {
+        pthread_mutex_init(&m, NULL);
+    }
+
+    void start(struct fuse_chan *chan) {
+        ch = chan;
+    }
+
+    // to be taken before anything is read for a reply
+    unsigned long long epoch() {
+        pthread_mutex_lock(&m);
+        unsigned long long e = releases;
+        pthread_mutex_unlock(&m);
+        return e;
+    }
+
+    void dorelease(lock_protocol::lockid_t lid) {
+        if (cache_timeout == 0 || ch == NULL) {
+            return;
+        }
+        pthread_mutex_lock(&m);
+        releases++;
+        pthread_mutex_unlock(&m);
+
+        // ENOENT only means the kernel had nothing cached
+#if FUSE_VERSION >= 28
+        fuse_lowlevel_notify_inval_inode(ch, lid, -1, 0);
+#endif
+    }
+
+    // the epoch check and the reply happen under m, so a release either
+    // comes after the reply or turns its timeout off
+    void replyAttr(fuse_req_t req, const struct stat &st, unsigned long long e) {
+        pthread_mutex_lock(&m);
+        fuse_reply_attr(req, &st, releases == e ? cache_timeout : 0);
+        pthread_mutex_unlock(&m);
+    }
+
+    // parentEpoch covers the name, inoEpoch the attributes in e; fi is set
+    // for replies to create
+    void replyEntry(fuse_req_t req, struct fuse_entry_param &e, unsigned long long parentEpoch,
+                    unsigned long long inoEpoch, struct fuse_file_info *fi) {
+        pthread_mutex_lock(&m);
+        e.entry_timeout = releases == parentEpoch ? entry_timeout : 0;
+        e.attr_timeout = releases == inoEpoch ? cache_timeout : 0;
+        if (fi != NULL) {
+            fuse_reply_create(req, &e, fi);
+        } else {
+            fuse_reply_entry(req, &e);
+        }
+        pthread_mutex_unlock(&m);
+    }
+};
+
+kernel_cache cache;
+
 int id() {
     return myid;
 }
@@ -68,12 +155,13 @@ fuseserver_getattr(fuse_req_t req, fuse_ino_t ino,
     yfs_client::inum inum = ino; // req->in.h.nodeid;
     yfs_client::status ret;
 
+    unsigned long long e = cache.epoch();
     ret = getattr(inum, st);
     if (ret != yfs_client::OK) {
         fuse_reply_err(req, ENOENT);
         return;
     }
-    fuse_reply_attr(req, &st, 0);
+    cache.replyAttr(req, st, e);
 }
 
 void
@@ -82,8 +170,12 @@ fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set
     if (yfs->isfile(ino) && FUSE_SET_ATTR_SIZE & to_set) {
         printf("   fuseserver_setattr set size to %zu\n", attr->st_size);
         struct stat st;
-        if (yfs->setSize(ino, attr->st_size) == yfs_client::OK && getattr(ino, st) == yfs_client::OK) {
-            fuse_reply_attr(req, &st, 0);
+        unsigned long long e = cache.epoch();
+        yfs_client::status ret = yfs->setSize(ino, attr->st_size);
+        if (ret == yfs_client::OK && getattr(ino, st) == yfs_client::OK) {
+            cache.replyAttr(req, st, e);
+        } else if (ret == yfs_client::FBIG) {
+            fuse_reply_err(req, EFBIG);
         } else {
             fuse_reply_err(req, ENOENT);
         }
@@ -92,14 +184,36 @@ fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set
     }
 }
 
+// replies to a read from the pages of the extent cache
+class reply_reader : public extent_reader {
+    fuse_req_t req;
+
+public:
+    reply_reader(fuse_req_t req) : req(req) {}
+
+    void consume(const struct iovec *iov, int count) {
+#if FUSE_VERSION >= 27
+        fuse_reply_iov(req, iov, count);
+#else
+        size_t size = 0;
+        for (int i = 0; i < count; i++) {
+            size += iov[i].iov_len;
+        }
+        char *buf = (char *) malloc(size);
+        for (int i = 0, done = 0; i < count; done += iov[i].iov_len, i++) {
+            memcpy(buf + done, iov[i].iov_base, iov[i].iov_len);
+        }
+        fuse_reply_buf(req, buf, size);
+        free(buf);
+#endif
+    }
+};
+
 void
 fuseserver_read(fuse_req_t req, fuse_ino_t ino, size_t size,
                 off_t off, struct fuse_file_info *fi) {
-    std::string tmp;
-    if (yfs->read(ino, size, off, tmp) == yfs_client::OK) {
-        auto buf = tmp.c_str();
-        fuse_reply_buf(req, buf, tmp.size());
-    } else {
+    reply_reader reader(req);
+    if (yfs->read(ino, size, off, reader) != yfs_client::OK) {
         fuse_reply_err(req, ENOSYS);
     }
 }
@@ -108,10 +222,11 @@ void
 fuseserver_write(fuse_req_t req, fuse_ino_t ino,
                  const char *buf, size_t size, off_t off,
                  struct fuse_file_info *fi) {
-    std::string tmp(buf, size);
-
-    if (yfs->write(ino, off, tmp) == yfs_client::OK) {
+    yfs_client::status ret = yfs->write(ino, off, buf, size);
+    if (ret == yfs_client::OK) {
         fuse_reply_write(req, size);
+    } else if (ret == yfs_client::FBIG) {
+        fuse_reply_err(req, EFBIG);
     } else {
         fuse_reply_err(req, ENOSYS);
     }
@@ -119,7 +234,7 @@ fuseserver_write(fuse_req_t req, fuse_ino_t ino,
 
 yfs_client::status
 fuseserver_createhelper(fuse_ino_t parent, const char *name,
-                        mode_t mode, struct fuse_entry_param *e) {
+                        mode_t mode, struct fuse_entry_param *e, unsigned long long &inoEpoch) {
     yfs_client::inum createdInum;
     yfs_client::status returnValue;
     if ((returnValue = yfs->createNode(parent, std::string(name), createdInum, false)) == yfs_client::OK) {
@@ -129,6 +244,7 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
         e->ino = createdInum;
 
         struct stat fileStat;
+        inoEpoch = cache.epoch();
         if ((returnValue = getattr(createdInum, fileStat)) == yfs_client::OK) {
             e->attr = fileStat;
         }
@@ -144,8 +260,9 @@ fuseserver_create(fuse_req_t req, fuse_ino_t parent, const char *name,
                   mode_t mode, struct fuse_file_info *fi) {
     struct fuse_entry_param e;
     yfs_client::status ret;
-    if ((ret = fuseserver_createhelper(parent, name, mode, &e)) == yfs_client::OK) {
-        fuse_reply_create(req, &e, fi);
+    unsigned long long parentEpoch = cache.epoch(), inoEpoch;
+    if ((ret = fuseserver_createhelper(parent, name, mode, &e, inoEpoch)) == yfs_client::OK) {
+        cache.replyEntry(req, e, parentEpoch, inoEpoch, fi);
     } else if (ret == yfs_client::EXISTING) {
         fuse_reply_err(req, EEXIST);
     } else {
@@ -156,8 +273,9 @@ fuseserver_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 void fuseserver_mknod(fuse_req_t req, fuse_ino_t parent,
                       const char *name, mode_t mode, dev_t rdev) {
     struct fuse_entry_param e;
-    if (fuseserver_createhelper(parent, name, mode, &e) == yfs_client::OK) {
-        fuse_reply_entry(req, &e);
+    unsigned long long parentEpoch = cache.epoch(), inoEpoch;
+    if (fuseserver_createhelper(parent, name, mode, &e, inoEpoch) == yfs_client::OK) {
+        cache.replyEntry(req, e, parentEpoch, inoEpoch, NULL);
     } else {
         fuse_reply_err(req, ENOENT);
     }
@@ -167,9 +285,9 @@ void
 fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
     struct fuse_entry_param e;
     bool found = false;
+    unsigned long long parentEpoch = cache.epoch(), inoEpoch = 0;
 
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
+    memset(&e, 0, sizeof(e));
 
     // You fill this in:
     // Look up the file named `name' in the directory referred to by
@@ -178,6 +296,7 @@ fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
     yfs_client::inum fileInum;
     if (yfs->lookUp_ino(parent, name, fileInum) == yfs_client::OK) {
         struct stat fileStat;
+        inoEpoch = cache.epoch();
         if (getattr(fileInum, fileStat) == yfs_client::OK) {
             e.ino = fileInum;
             e.attr = fileStat;
@@ -186,7 +305,7 @@ fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
     }
 
     if (found)
-        fuse_reply_entry(req, &e);
+        cache.replyEntry(req, e, parentEpoch, inoEpoch, NULL);
     else
         fuse_reply_err(req, ENOENT);
 }
@@ -195,56 +314,134 @@ fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
 struct dirbuf {
     char *p;
     size_t size;
+    size_t max;
 };
 
-void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino) {
+// off is what fuse passes back to readdir to continue after this entry.
+// the file type goes along so that ls and find need not stat every entry
+bool dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino, off_t off) {
     struct stat stbuf;
-    size_t oldsize = b->size;
-    b->size += fuse_dirent_size(strlen(name));
-    b->p = (char *) realloc(b->p, b->size);
+    size_t entsize = fuse_dirent_size(strlen(name));
+    if (b->size + entsize > b->max) {
+        return false;
+    }
     memset(&stbuf, 0, sizeof(stbuf));
     stbuf.st_ino = ino;
-    fuse_add_dirent(b->p + oldsize, name, &stbuf, b->size);
+    stbuf.st_mode = yfs->isfile(ino) ? S_IFREG : S_IFDIR;
+    fuse_add_dirent(b->p + b->size, name, &stbuf, off);
+    b->size += entsize;
+    return true;
 }
 
-#define min(x, y) ((x) < (y) ? (x) : (y))
+// what an open directory has listed so far, kept in fi->fh. the offsets
+// given to the kernel are positions in entries, so they stay valid however
+// the directory is rewritten on the server. each readdir only fetches the
+// entries it is going to return, and a rewind to 0 starts a fresh listing
+struct dir_handle {
+    pthread_mutex_t m;
+    std::vector<yfs_client::dirent> entries;
+    unsigned long long cursor;     // where the listing goes on at the server
+    bool complete;
+    std::set<std::string> seen;    // names listed before a restart
+};
 
-int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize,
-                      off_t off, size_t maxsize) {
-    if ((size_t) off < bufsize)
-        return fuse_reply_buf(req, buf + off, min(bufsize - off, maxsize));
-    else
-        return fuse_reply_buf(req, NULL, 0);
+static const unsigned int readdir_batch = 256;
+
+// fetch the next batch into h. a STALE cursor means the directory was
+// rewritten: list it again from the start, skipping the names already
+// handed out
+static int
+dirFill(dir_handle *h, yfs_client::inum inum) {
+    std::vector<yfs_client::dirent> entries;
+    std::vector<unsigned long long> cursors;
+    int ret;
+
+    while ((ret = yfs->readdir(inum, h->cursor, readdir_batch, entries, cursors)) == yfs_client::STALE) {
+        for (auto &e : h->entries) {
+            h->seen.insert(e.name);
+        }
+        h->cursor = 0;
+    }
+    if (ret != yfs_client::OK) {
+        return ret;
+    }
+
+    if (entries.empty()) {
+        h->complete = true;
+        return yfs_client::OK;
+    }
+    for (auto &e : entries) {
+        if (h->seen.find(e.name) == h->seen.end()) {
+            h->entries.push_back(e);
+        }
+    }
+    h->cursor = cursors.back();
+    return yfs_client::OK;
+}
+
+void
+fuseserver_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (!yfs->isdir(ino)) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    dir_handle *h = new dir_handle;
+    pthread_mutex_init(&h->m, NULL);
+    h->cursor = 0;
+    h->complete = false;
+    fi->fh = (uintptr_t) h;
+    fuse_reply_open(req, fi);
+}
+
+void
+fuseserver_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    dir_handle *h = (dir_handle *) (uintptr_t) fi->fh;
+    pthread_mutex_destroy(&h->m);
+    delete h;
+    fuse_reply_err(req, 0);
 }
 
 void
 fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
                    off_t off, struct fuse_file_info *fi) {
     yfs_client::inum inum = ino; // req->in.h.nodeid;
+    dir_handle *h = (dir_handle *) (uintptr_t) fi->fh;
     struct dirbuf b;
-    yfs_client::dirent e;
 
     printf("fuseserver_readdir\n");
 
-    if (!yfs->isdir(inum)) {
-        fuse_reply_err(req, ENOTDIR);
-        return;
+    pthread_mutex_lock(&h->m);
+    if (off == 0) {
+        h->entries.clear();
+        h->seen.clear();
+        h->cursor = 0;
+        h->complete = false;
     }
 
-    memset(&b, 0, sizeof(b));
-
-
-    // fill in the b data structure using dirbuf_add (TODO: What do if problem arises?)
-    std::string serializedData;
-    if (yfs->getDirData(ino, serializedData) == yfs_client::OK) {
-        std::map <std::string, yfs_client::inum> dirData = yfs_client::unserializeDirectoryEntries(serializedData);
-        for (auto &it: dirData) {
-            dirbuf_add(&b, it.first.c_str(), it.second);
+    b.p = (char *) malloc(size);
+    b.size = 0;
+    b.max = size;
+    size_t i = off;
+    while (true) {
+        if (i >= h->entries.size() && !h->complete) {
+            if (dirFill(h, inum) != yfs_client::OK) {
+                pthread_mutex_unlock(&h->m);
+                free(b.p);
+                fuse_reply_err(req, EIO);
+                return;
+            }
+            continue;
+        }
+        if (i >= h->entries.size() ||
+            !dirbuf_add(&b, h->entries[i].name.c_str(), h->entries[i].inum, i + 1)) {
+            break;
         }
+        i++;
     }
+    pthread_mutex_unlock(&h->m);
 
-
-    reply_buf_limited(req, b.p, b.size, off, size);
+    fuse_reply_buf(req, b.p, b.size);
     free(b.p);
 }
 
@@ -259,6 +456,7 @@ fuseserver_open(fuse_req_t req, fuse_ino_t ino,
 void
 fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
     yfs_client::inum createdInum;
+    unsigned long long parentEpoch = cache.epoch();
     if (yfs->createNode(parent, std::string(name), createdInum, true) == yfs_client::OK) {
         struct fuse_entry_param e;
         e.attr_timeout = 0;
@@ -267,14 +465,13 @@ fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mod
         e.ino = createdInum;
 
         struct stat fileStat;
-        yfs_client::status ret;
-        if ((ret = getattr(createdInum, fileStat)) == yfs_client::OK) {
+        unsigned long long inoEpoch = cache.epoch();
+        if (getattr(createdInum, fileStat) == yfs_client::OK) {
             e.attr = fileStat;
+            cache.replyEntry(req, e, parentEpoch, inoEpoch, NULL);
         } else {
             fuse_reply_err(req, ENOSYS);
         }
-
-        fuse_reply_entry(req, &e);
     } else {
         fuse_reply_err(req, ENOSYS);
     }
@@ -306,6 +503,33 @@ fuseserver_statfs(fuse_req_t req) {
 
 struct fuse_lowlevel_ops fuseserver_oper;
 
+// fuse 2.5 only has a multithreaded loop with a fixed number of threads,
+// so the workers are ours. each one takes the next request from the
+// channel, and the kernel hands every request to exactly one of them
+static void *
+fuseworker(void *x) {
+    struct fuse_session *se = (struct fuse_session *) x;
+    struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+    size_t bufsize = fuse_chan_bufsize(ch);
+    char *buf = (char *) malloc(bufsize);
+
+    while (!fuse_session_exited(se)) {
+        int res = fuse_chan_receive(ch, buf, bufsize);
+        if (res == 0) {
+            continue;
+        }
+        if (res < 0) {
+            // unmounted; wake up the others too
+            fuse_session_exit(se);
+            break;
+        }
+        fuse_session_process(se, buf, res, ch);
+    }
+
+    free(buf);
+    return 0;
+}
+
 int
 main(int argc, char *argv[]) {
     char *mountpoint = 0;
@@ -324,11 +548,29 @@ main(int argc, char *argv[]) {
 
     myid = random();
 
-    yfs = new yfs_client(argv[2], argv[3]);
+    // the extent cache is capped at YFS_CACHE_MB megabytes
+    size_t cacheBytes = extent_client::default_cache_bytes;
+    char *cache_env = getenv("YFS_CACHE_MB");
+    if (cache_env != NULL && atoi(cache_env) > 0) {
+        cacheBytes = (size_t) atoi(cache_env) << 20;
+    }
+
+    // tell the kernel to forget whatever it cached under a lock that is
+    // given back
+    yfs = new yfs_client(argv[2], argv[3], cacheBytes, &cache);
+
+    // requests are served by YFS_FUSE_THREADS threads
+    int nthreads = 8;
+    char *threads_env = getenv("YFS_FUSE_THREADS");
+    if (threads_env != NULL && atoi(threads_env) > 0) {
+        nthreads = atoi(threads_env);
+    }
 
     fuseserver_oper.getattr = fuseserver_getattr;
     fuseserver_oper.statfs = fuseserver_statfs;
+    fuseserver_oper.opendir = fuseserver_opendir;
     fuseserver_oper.readdir = fuseserver_readdir;
+    fuseserver_oper.releasedir = fuseserver_releasedir;
     fuseserver_oper.lookup = fuseserver_lookup;
     fuseserver_oper.create = fuseserver_create;
     fuseserver_oper.mknod = fuseserver_mknod;
@@ -358,7 +600,7 @@ main(int argc, char *argv[]) {
 
     fuse_args args = FUSE_ARGS_INIT(fuse_argc, (char **) fuse_argv);
     int foreground;
-    int res = fuse_parse_cmdline(&args, &mountpoint, 0 /*multithreaded*/,
+    int res = fuse_parse_cmdline(&args, &mountpoint, 0 /*multithreaded, see nthreads*/,
                                  &foreground);
     if (res == -1) {
         fprintf(stderr, "fuse_parse_cmdline failed\n");
@@ -389,8 +631,20 @@ main(int argc, char *argv[]) {
     }
 
     fuse_session_add_chan(se, ch);
-    // err = fuse_session_loop_mt(se);   // FK: wheelfs does this; why?
-    err = fuse_session_loop(se);
+    cache.start(ch);
+    if (nthreads == 1) {
+        err = fuse_session_loop(se);
+    } else {
+        pthread_t th[nthreads];
+        for (int i = 0; i < nthreads; i++) {
+            int r = pthread_create(&th[i], NULL, fuseworker, se);
+            assert(r == 0);
+        }
+        for (int i = 0; i < nthreads; i++) {
+            pthread_join(th[i], NULL);
+        }
+        err = 0;
+    }
 
     fuse_session_destroy(se);
     close(fd);
@@ -45,6 +45,9 @@ lock_client_cache::lock_client_cache(std::string xdst,
     rpcs *rlsrpc = new rpcs(rlock_port);
     rlsrpc->reg(rlock_protocol::retry, this, &lock_client_cache::retry);
     rlsrpc->reg(rlock_protocol::revoke, this, &lock_client_cache::revoke);
+    // both only queue the lock for the retryer and revoker threads
+    rlsrpc->set_short(rlock_protocol::retry);
+    rlsrpc->set_short(rlock_protocol::revoke);
 
     rsmc = new rsm_client(xdst);
 
@@ -175,6 +178,23 @@ lock_client_cache::release(lock_protocol::lockid_t lid) {
     return lock_protocol::OK;
 }
 
+bool
+lock_client_cache::owned(lock_protocol::lockid_t lid) {
+    pthread_mutex_lock(&infoLock);
+    auto it = infoMap.find(lid);
+    if (it == infoMap.end()) {
+        pthread_mutex_unlock(&infoLock);
+        return false;
+    }
+    lock_info &info = it->second;
+    pthread_mutex_unlock(&infoLock);
+
+    pthread_mutex_lock(&lockMap[lid]);
+    bool ret = (info.state == FREE || info.state == LOCKED) && !info.toRevoke;
+    pthread_mutex_unlock(&lockMap[lid]);
+    return ret;
+}
+
 void
 lock_client_cache::releaser() {
     // This method should be a continuous loop, waiting to be notified of
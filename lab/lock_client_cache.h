@@ -123,6 +123,10 @@ public:
 
     virtual lock_protocol::status release(lock_protocol::lockid_t);
 
+    // whether this client owns the lock and no revoke is pending, so that
+    // it keeps it until dorelease is called
+    bool owned(lock_protocol::lockid_t);
+
     rlock_protocol::status retry(lock_protocol::lockid_t, int ver, int &);
 
     rlock_protocol::status revoke(lock_protocol::lockid_t, int ver, int &);
@@ -139,6 +139,36 @@ proposer::run(int instance, std::vector <std::string> newnodes, std::string newv
     return r;
 }
 
+// one call to each node, all of them out at once, so that a round takes
+// as long as the slowest node rather than the sum of them all. calls[i]
+// went to nodes[i]; nodes without a connection are left out
+struct fanout {
+    std::list<handle> handles;      // keep the rpccs alive under the calls
+    std::vector<std::string> nodes;
+    std::vector<rpc_future *> calls;
+
+    template<class A>
+    fanout(const std::vector<std::string> &to, unsigned int proc,
+           const std::string &me, const A &a) {
+        for (auto &node : to) {
+            handles.emplace_back(node);
+            auto cl = handles.back().get_rpcc();
+            if (!cl) {
+                continue;
+            }
+            nodes.push_back(node);
+            calls.push_back(cl->async_call(proc, rpcc::to(1000), me, a));
+        }
+        when_all(calls);
+    }
+
+    ~fanout() {
+        for (auto f : calls) {
+            delete f;
+        }
+    }
+};
+
 bool
 proposer::prepare(unsigned instance, std::vector <std::string> &accepts,
                   std::vector <std::string> nodes,
@@ -152,16 +182,9 @@ proposer::prepare(unsigned instance, std::vector <std::string> &accepts,
 
     prop_t highest_n_a = {0, std::string()};
 
-    for (auto &node : nodes) {
-        handle h(node);
-
-        auto cl = h.get_rpcc();
-
-        if (!cl) {
-            continue;
-        }
-
-        auto ret = cl->call(paxos_protocol::preparereq, me, a, r, rpcc::to(1000));
+    fanout out(nodes, paxos_protocol::preparereq, me, a);
+    for (size_t i = 0; i < out.calls.size(); i++) {
+        auto ret = out.calls[i]->get(r);
 
         // PHASE 2
         if (ret == paxos_protocol::OK) {
@@ -175,7 +198,7 @@ proposer::prepare(unsigned instance, std::vector <std::string> &accepts,
                     v = r.v_a;
                     highest_n_a = r.n_a;
                 }
-                accepts.push_back(node);
+                accepts.push_back(out.nodes[i]);
             }
         }
     }
@@ -192,20 +215,13 @@ proposer::accept(unsigned instance, std::vector <std::string> &accepts,
     a.n = my_n;
     a.v = v;
 
-    for (auto &node : nodes) {
-        handle h(node);
-
-        auto cl = h.get_rpcc();
-
-        if (!cl) {
-            continue;
-        }
-
+    fanout out(nodes, paxos_protocol::acceptreq, me, a);
+    for (size_t i = 0; i < out.calls.size(); i++) {
         int r;
-        auto ret = cl->call(paxos_protocol::acceptreq, me, a, r, rpcc::to(1000));
+        auto ret = out.calls[i]->get(r);
 
         if (ret == paxos_protocol::OK && r) {
-            accepts.push_back(node);
+            accepts.push_back(out.nodes[i]);
         }
     }
 }
@@ -217,18 +233,7 @@ proposer::decide(unsigned instance, std::vector <std::string> accepts,
     a.instance = instance;
     a.v = v;
 
-    for (auto &node : accepts) {
-        handle h(node);
-
-        auto cl = h.get_rpcc();
-
-        if (!cl) {
-            continue;
-        }
-
-        int r;
-        cl->call(paxos_protocol::decidereq, me, a, r, rpcc::to(1000));
-    }
+    fanout out(accepts, paxos_protocol::decidereq, me, a);
 }
 
 acceptor::acceptor(class paxos_change *_cfg, bool _first, std::string _me,
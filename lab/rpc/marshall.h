@@ -10,6 +10,8 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <endian.h>
 
 struct req_header {
     req_header(int x = 0, int p = 0, int c = 0, int s = 0, int xi = 0) :
@@ -48,6 +50,18 @@ private:
     int _capa;      // Capacity of the buffer
     int _ind;       // Read/write head position
 
+    void grow(int n);
+
+    // n more bytes at the head, to be filled in by the caller
+    char *room(int n) {
+        if (_ind + n > _capa) {
+            grow(n);
+        }
+        char *p = _buf + _ind;
+        _ind += n;
+        return p;
+    }
+
 public:
     marshall() {
         _buf = (char *) malloc(sizeof(char) * DEFAULT_RPC_SZ);
@@ -65,9 +79,37 @@ public:
 
     char *cstr() { return _buf; }
 
-    void rawbyte(unsigned char);
+    void rawbyte(unsigned char x) {
+        *room(1) = x;
+    }
+
+    void rawbytes(const char *p, int n) {
+        memcpy(room(n), p, n);
+    }
 
-    void rawbytes(const char *, int);
+    // integers in network order, each with a single store
+    void put16(uint16_t x) {
+        x = htobe16(x);
+        memcpy(room(sizeof(x)), &x, sizeof(x));
+    }
+
+    void put32(uint32_t x) {
+        x = htobe32(x);
+        memcpy(room(sizeof(x)), &x, sizeof(x));
+    }
+
+    void put64(uint64_t x) {
+        x = htobe64(x);
+        memcpy(room(sizeof(x)), &x, sizeof(x));
+    }
+
+    // make room for n more bytes up front, so a large value is copied
+    // in once instead of being moved along with every realloc
+    void reserve(int n) {
+        if (_ind + n > _capa) {
+            grow(n);
+        }
+    }
 
     // Return the current content (excluding header) as a string
     std::string get_content() {
@@ -79,7 +121,9 @@ public:
         return get_content();
     }
 
-    void pack(int i);
+    void pack(int i) {
+        put32(i);
+    }
 
     void pack_req_header(const req_header &h) {
         int saved_sz = _ind;
@@ -134,6 +178,35 @@ marshall &operator<<(marshall &, unsigned long long);
 
 marshall &operator<<(marshall &, const std::string &);
 
+// the bytes a value takes on the wire, so that a request buffer can be
+// sized once for all of its arguments; 0 where it is not known up front
+inline int marshall_size() { return 0; }
+
+template<class T>
+inline int marshall_size(const T &) { return 0; }
+
+inline int marshall_size(char) { return 1; }
+
+inline int marshall_size(unsigned char) { return 1; }
+
+inline int marshall_size(short) { return 2; }
+
+inline int marshall_size(unsigned short) { return 2; }
+
+inline int marshall_size(int) { return 4; }
+
+inline int marshall_size(unsigned int) { return 4; }
+
+inline int marshall_size(unsigned long long) { return 8; }
+
+inline int marshall_size(const std::string &s) { return 4 + s.size(); }
+
+template<class T, class... Rest>
+inline int
+marshall_size(const T &a, const Rest &... rest) {
+    return marshall_size(a) + marshall_size(rest...);
+}
+
 class unmarshall {
 private:
     char *_buf;
@@ -173,7 +246,48 @@ public:
 
     bool okdone();
 
-    unsigned int rawbyte();
+    // n bytes at the head, or NULL past the end
+    const char *take(unsigned int n) {
+        if (n > (unsigned) (_sz - _ind)) {
+            _ok = false;
+            return NULL;
+        }
+        const char *p = _buf + _ind;
+        _ind += n;
+        return p;
+    }
+
+    unsigned int rawbyte() {
+        const char *p = take(1);
+        return p != NULL ? *p : 0;
+    }
+
+    uint16_t get16() {
+        uint16_t x = 0;
+        const char *p = take(sizeof(x));
+        if (p != NULL) {
+            memcpy(&x, p, sizeof(x));
+        }
+        return be16toh(x);
+    }
+
+    uint32_t get32() {
+        uint32_t x = 0;
+        const char *p = take(sizeof(x));
+        if (p != NULL) {
+            memcpy(&x, p, sizeof(x));
+        }
+        return be32toh(x);
+    }
+
+    uint64_t get64() {
+        uint64_t x = 0;
+        const char *p = take(sizeof(x));
+        if (p != NULL) {
+            memcpy(&x, p, sizeof(x));
+        }
+        return be64toh(x);
+    }
 
     void rawbytes(std::string &s, unsigned int n);
 
@@ -181,7 +295,10 @@ public:
 
     int size() { return _sz; }
 
-    void unpack(int *); //non-const ref
+    void unpack(int *x) { //non-const ref
+        *x = get32();
+    }
+
     void take_buf(char **b, int *sz) {
         *b = _buf;
         *sz = _sz;
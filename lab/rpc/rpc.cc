@@ -80,7 +80,7 @@ const rpcc::TO rpcc::to_max = {120000};
 const rpcc::TO rpcc::to_min = {1000};
 
 rpcc::caller::caller(unsigned int xxid, unmarshall *xun)
-        : xid(xxid), un(xun), done(false) {
+        : xid(xxid), un(xun), done(false), waitset(NULL) {
     assert(pthread_mutex_init(&m, 0) == 0);
     assert(pthread_cond_init(&c, 0) == 0);
 }
@@ -90,6 +90,28 @@ rpcc::caller::~caller() {
     assert(pthread_cond_destroy(&c) == 0);
 }
 
+// a thread waiting for any of several calls, see when_quorum. lock order:
+// rpcc::m_, then rpc_waitset::m, then caller::m
+struct rpc_waitset {
+    pthread_mutex_t m;
+    pthread_cond_t c;
+
+    rpc_waitset() {
+        assert(pthread_mutex_init(&m, 0) == 0);
+        assert(pthread_cond_init(&c, 0) == 0);
+    }
+
+    ~rpc_waitset() {
+        assert(pthread_mutex_destroy(&m) == 0);
+        assert(pthread_cond_destroy(&c) == 0);
+    }
+
+    void wakeup() {
+        ScopedLock wl(&m);
+        assert(pthread_cond_broadcast(&c) == 0);
+    }
+};
+
 inline
 void set_rand_seed() {
     struct timespec ts;
@@ -171,6 +193,9 @@ rpcc::cancel(void) {
             ca->intret = rpc_const::cancel_failure;
             assert(pthread_cond_signal(&ca->c) == 0);
         }
+        if (ca->waitset) {
+            ca->waitset->wakeup();
+        }
     }
 
     while (calls_.size() > 0) {
@@ -185,51 +210,81 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
             TO to) {
 
     caller ca(0, &rep);
-    {
-        ScopedLock ml(&m_);
+    int ret = start_call(proc, req, ca);
+    if (ret != 0) {
+        return ret;
+    }
 
-        if ((proc != rpc_const::bind && !bind_done_) ||
-            (proc == rpc_const::bind && bind_done_)) {
-            jsl_log(JSL_DBG_1, "rpcc::call1 rpcc has not been bound to dst or binding twice\n");
-            return rpc_const::bind_failure;
-        }
+    struct timespec now, finaldeadline;
+    clock_gettime(CLOCK_REALTIME, &now);
+    add_timespec(now, to.to, &finaldeadline);
 
-        if (destroy_wait_) {
-            return rpc_const::cancel_failure;
-        }
+    connection *ch = NULL;
+    transmit(proc, req, ca, ch);
+    return finish_call(proc, req, ca, ch, finaldeadline);
+}
 
-        ca.xid = xid_++;
-        calls_[ca.xid] = &ca;
+// assigns the xid and registers ca for the reply
+int
+rpcc::start_call(unsigned int proc, marshall &req, caller &ca) {
+    ScopedLock ml(&m_);
 
-        req_header h(ca.xid, proc, clt_nonce_, srv_nonce_, xid_rep_window_.front());
-        req.pack_req_header(h);
+    if ((proc != rpc_const::bind && !bind_done_) ||
+        (proc == rpc_const::bind && bind_done_)) {
+        jsl_log(JSL_DBG_1, "rpcc::call1 rpcc has not been bound to dst or binding twice\n");
+        return rpc_const::bind_failure;
     }
 
+    if (destroy_wait_) {
+        return rpc_const::cancel_failure;
+    }
 
-    TO curr_to;
-    struct timespec now, nextdeadline, finaldeadline;
+    ca.xid = xid_++;
+    calls_[ca.xid] = &ca;
 
-    clock_gettime(CLOCK_REALTIME, &now);
-    add_timespec(now, to.to, &finaldeadline);
+    req_header h(ca.xid, proc, clt_nonce_, srv_nonce_, xid_rep_window_.front());
+    req.pack_req_header(h);
+    return 0;
+}
+
+void
+rpcc::transmit(unsigned int proc, marshall &req, caller &ca, connection *&ch) {
+    get_refconn(&ch);
+    if (ch) {
+        if (reachable_) ch->send(req.cstr(), req.size());
+        else
+            jsl_log(JSL_DBG_1, "not reachable\n");
+        jsl_log(JSL_DBG_2,
+                "rpcc::call1 %u just sent req proc %x xid %u clt_nonce %d\n",
+                clt_nonce_, proc, ca.xid, clt_nonce_);
+    }
+}
+
+// only send once on a given channel
+void
+rpcc::retransmit(unsigned int proc, marshall &req, caller &ca, connection *&ch) {
+    if (retrans_ && (!ch || ch->isdead())) {
+        //since connection is dead, we retransmit on the new connection
+        transmit(proc, req, ca, ch);
+    }
+}
+
+// waits for the reply of a started call and unregisters it
+int
+rpcc::finish_call(unsigned int proc, marshall &req, caller &ca, connection *&ch,
+                  struct timespec finaldeadline) {
+    TO curr_to;
+    struct timespec now, nextdeadline;
     curr_to.to = to_min.to;
 
-    bool transmit = true;
-    connection *ch = NULL;
+    bool again = false;
 
     while (1) {
 
-        if (transmit) {
-            get_refconn(&ch);
-            if (ch) {
-                if (reachable_) ch->send(req.cstr(), req.size());
-                else
-                    jsl_log(JSL_DBG_1, "not reachable\n");
-                jsl_log(JSL_DBG_2,
-                        "rpcc::call1 %u just sent req proc %x xid %u clt_nonce %d\n",
-                        clt_nonce_, proc, ca.xid, clt_nonce_);
-            }
-            transmit = false; //only send once on a given channel
+        if (again) {
+            retransmit(proc, req, ca, ch);
         }
+        again = true;
 
         if (!finaldeadline.tv_sec)
             break;
@@ -256,13 +311,28 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
             }
         }
 
-        if (retrans_ && (!ch || ch->isdead())) {
-            //since connection is dead, we retransmit on the new connection
-            transmit = true;
-        }
         curr_to.to <<= 1;
     }
 
+    end_call(ca, NULL);
+
+    ScopedLock cal(&ca.m);
+
+    jsl_log(JSL_DBG_2,
+            "rpcc::call1 %u call done for req proc %x xid %u %s:%d done? %d ret %d \n",
+            clt_nonce_, proc, ca.xid, inet_ntoa(dst_.sin_addr),
+            ntohs(dst_.sin_port), ca.done, ca.intret);
+
+    if (ch) {
+        ch->decref();
+        ch = NULL;
+    }
+    //destruction of req automatically frees its buffer
+    return (ca.done ? ca.intret : rpc_const::timeout_failure);
+}
+
+void
+rpcc::end_call(caller &ca, connection *ch) {
     {
         ScopedLock ml(&m_); //no locking of ca.m because no one but this thread changes ca.xid
         calls_.erase(ca.xid);
@@ -275,18 +345,8 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
             assert(pthread_cond_signal(&destroy_wait_c_) == 0);
         }
     }
-
-    ScopedLock cal(&ca.m);
-
-    jsl_log(JSL_DBG_2,
-            "rpcc::call1 %u call done for req proc %x xid %u %s:%d done? %d ret %d \n",
-            clt_nonce_, proc, ca.xid, inet_ntoa(dst_.sin_addr),
-            ntohs(dst_.sin_port), ca.done, ca.intret);
-
     if (ch)
         ch->decref();
-    //destruction of req automatically frees its buffer
-    return (ca.done ? ca.intret : rpc_const::timeout_failure);
 }
 
 void
@@ -333,20 +393,149 @@ rpcc::got_pdu(connection *c, char *b, int sz) {
     }
     caller *ca = calls_[h.xid];
 
-    ScopedLock cl(&ca->m);
-    if (!ca->done) {
-        ca->un->take_in(rep);
-        ca->intret = h.ret;
-        if (ca->intret < 0) {
-            jsl_log(JSL_DBG_2, "rpcc::got_pdu: RPC reply error for xid %d intret %d\n",
-                    h.xid, ca->intret);
+    {
+        ScopedLock cl(&ca->m);
+        if (!ca->done) {
+            ca->un->take_in(rep);
+            ca->intret = h.ret;
+            if (ca->intret < 0) {
+                jsl_log(JSL_DBG_2, "rpcc::got_pdu: RPC reply error for xid %d intret %d\n",
+                        h.xid, ca->intret);
+            }
+            ca->done = 1;
         }
-        ca->done = 1;
+        assert(pthread_cond_broadcast(&ca->c) == 0);
+    }
+    // m_ keeps the waitset from being detached meanwhile
+    if (ca->waitset) {
+        ca->waitset->wakeup();
     }
-    assert(pthread_cond_broadcast(&ca->c) == 0);
     return true;
 }
 
+void
+rpcc::set_waitset(caller &ca, rpc_waitset *ws) {
+    ScopedLock ml(&m_);
+    ca.waitset = ws;
+}
+
+void
+rpcc::start_async(rpc_future *f, int to) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    add_timespec(now, to, &f->deadline_);
+
+    f->ret_ = start_call(f->proc_, f->req_, f->ca_);
+    if (f->ret_ != 0) {
+        f->finished_ = true;
+        return;
+    }
+    transmit(f->proc_, f->req_, f->ca_, f->ch_);
+}
+
+rpc_future::rpc_future(rpcc *cl, unsigned int proc)
+        : cl_(cl), proc_(proc), ca_(0, &rep_), ch_(NULL), finished_(false), ret_(0) {
+}
+
+rpc_future::~rpc_future() {
+    if (!finished_) {
+        cl_->end_call(ca_, ch_);
+    }
+}
+
+int
+rpc_future::wait() {
+    if (!finished_) {
+        ret_ = cl_->finish_call(proc_, req_, ca_, ch_, deadline_);
+        finished_ = true;
+    }
+    return ret_;
+}
+
+bool
+rpc_future::ready() {
+    if (finished_) {
+        return true;
+    }
+    ScopedLock cal(&ca_.m);
+    return ca_.done;
+}
+
+int
+when_all(std::vector<rpc_future *> &calls) {
+    int replies = 0;
+    for (rpc_future *f : calls) {
+        if (f->wait() >= 0) {
+            replies++;
+        }
+    }
+    return replies;
+}
+
+// like rpcc::finish_call, for all calls at once: sleep until a reply comes
+// in or the next retransmission is due
+int
+when_quorum(std::vector<rpc_future *> &calls, size_t k) {
+    rpc_waitset ws;
+    for (rpc_future *f : calls) {
+        if (!f->finished_) {
+            f->cl_->set_waitset(f->ca_, &ws);
+        }
+    }
+
+    size_t replies;
+    int curr_to = rpcc::to_min.to;
+    struct timespec now, nextdeadline;
+
+    pthread_mutex_lock(&ws.m);
+    while (1) {
+        replies = 0;
+        size_t pending = 0;
+        clock_gettime(CLOCK_REALTIME, &now);
+        add_timespec(now, curr_to, &nextdeadline);
+        for (rpc_future *f : calls) {
+            bool done = f->finished_;
+            int intret = f->ret_;
+            if (!done) {
+                ScopedLock cal(&f->ca_.m);
+                done = f->ca_.done;
+                intret = f->ca_.intret;
+            }
+            if (done && intret >= 0) {
+                replies++;
+            } else if (!done && cmp_timespec(now, f->deadline_) < 0) {
+                pending++;
+                if (cmp_timespec(f->deadline_, nextdeadline) < 0) {
+                    nextdeadline = f->deadline_;
+                }
+            }
+        }
+        if (replies >= k || pending == 0) {
+            break;
+        }
+
+        if (pthread_cond_timedwait(&ws.c, &ws.m, &nextdeadline) == ETIMEDOUT) {
+            // sending may block on the pollmgr thread, which wants ws.m
+            pthread_mutex_unlock(&ws.m);
+            for (rpc_future *f : calls) {
+                if (!f->ready()) {
+                    f->cl_->retransmit(f->proc_, f->req_, f->ca_, f->ch_);
+                }
+            }
+            pthread_mutex_lock(&ws.m);
+            curr_to <<= 1;
+        }
+    }
+    pthread_mutex_unlock(&ws.m);
+
+    for (rpc_future *f : calls) {
+        if (!f->finished_) {
+            f->cl_->set_waitset(f->ca_, NULL);
+        }
+    }
+    return replies;
+}
+
 // assumes thread holds mutex m
 void
 rpcc::update_xid_rep(unsigned int xid) {
@@ -373,12 +562,14 @@ rpcc::update_xid_rep(unsigned int xid) {
 }
 
 
-rpcs::rpcs(unsigned int p1, int count)
-        : port_(p1), counting_(count), curr_counts_(count), lossytest_(0), reachable_(true) {
+rpcs::rpcs(unsigned int p1, int count, int threads, int maxthreads)
+        : port_(p1), last_reap_(0), counting_(count), curr_counts_(count), lossytest_(0), reachable_(true) {
     assert(pthread_mutex_init(&procs_m_, 0) == 0);
     assert(pthread_mutex_init(&count_m_, 0) == 0);
-    assert(pthread_mutex_init(&reply_window_m_, 0) == 0);
-    assert(pthread_mutex_init(&conss_m_, 0) == 0);
+    assert(pthread_mutex_init(&reap_m_, 0) == 0);
+    for (unsigned int i = 0; i < session_shards; i++) {
+        assert(pthread_mutex_init(&shards_[i].m, 0) == 0);
+    }
 
     set_rand_seed();
     nonce_ = random();
@@ -390,7 +581,9 @@ rpcs::rpcs(unsigned int p1, int count)
     }
 
     reg(rpc_const::bind, this, &rpcs::rpcbind);
-    dispatchpool_ = new ThrPool(10, false);
+    set_short(rpc_const::bind);
+    dispatchpool_ = new ThrPool(threads, false, maxthreads);
+    shortpool_ = new ThrPool(2, false);
 
     listener_ = new tcpsconn(this, port_, lossytest_);
 }
@@ -399,7 +592,12 @@ rpcs::~rpcs() {
     //must delete listener before dispatchpool
     delete listener_;
     delete dispatchpool_;
-    free_reply_window();
+    delete shortpool_;
+    free_sessions();
+    for (unsigned int i = 0; i < session_shards; i++) {
+        assert(pthread_mutex_destroy(&shards_[i].m) == 0);
+    }
+    assert(pthread_mutex_destroy(&reap_m_) == 0);
 }
 
 bool
@@ -409,9 +607,24 @@ rpcs::got_pdu(connection *c, char *b, int sz) {
         return true;
     }
 
+    // peek at the proc to pick the lane; dispatch checks the header
+    ThrPool *pool = dispatchpool_;
+    {
+        unmarshall req(b, sz);
+        req_header h;
+        req.unpack_req_header(&h);
+        req.take_buf(&b, &sz);
+        if (req.ok()) {
+            ScopedLock pl(&procs_m_);
+            if (short_procs_.count(h.proc)) {
+                pool = shortpool_;
+            }
+        }
+    }
+
     djob_t *j = new djob_t(c, b, sz);
     c->incref();
-    bool succ = dispatchpool_->addObjJob(this, &rpcs::dispatch, j);
+    bool succ = pool->addObjJob(this, &rpcs::dispatch, j);
     if (!succ || !reachable_) {
         c->decref();
         delete j;
@@ -427,6 +640,18 @@ rpcs::reg1(unsigned int proc, handler *h) {
     assert(procs_.count(proc) >= 1);
 }
 
+void
+rpcs::set_short(unsigned int proc) {
+    ScopedLock pl(&procs_m_);
+    short_procs_.insert(proc);
+}
+
+void
+rpcs::pool_stats(ThrPool::stats_t &dispatch, ThrPool::stats_t &fast) {
+    dispatchpool_->stats(dispatch);
+    shortpool_->stats(fast);
+}
+
 void
 rpcs::updatestat(unsigned int proc)
 {
@@ -441,17 +666,28 @@ rpcs::updatestat(unsigned int proc)
 		}
 		printf("\n");
 
-		ScopedLock rwl(&reply_window_m_);
-		std::map<unsigned int,std::list<reply_t> >::iterator clt;
-
-		unsigned int totalrep = 0, maxrep = 0;
-		for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++) {
-			totalrep += clt->second.size();
-			if (clt->second.size() > maxrep)
-				maxrep = clt->second.size();
+		unsigned int clients = 0, totalrep = 0, maxrep = 0;
+		for (unsigned int i = 0; i < session_shards; i++) {
+			ScopedLock sl(&shards_[i].m);
+			for (auto &clt : shards_[i].sessions) {
+				ScopedLock cl(&clt.second->m);
+				clients++;
+				totalrep += clt.second->replies.size();
+				if (clt.second->replies.size() > maxrep)
+					maxrep = clt.second->replies.size();
+			}
+		}
+		jsl_log(JSL_DBG_1, "REPLY WINDOW: clients %u total reply %d max per client %d\n", 
+				clients, totalrep, maxrep);
+
+		ThrPool::stats_t ps[2];
+		pool_stats(ps[0], ps[1]);
+		for (int i = 0; i < 2; i++) {
+			jsl_log(JSL_DBG_1, "%s POOL: threads %d jobs %llu stolen %llu dropped %llu depth %d max %d "
+					"wait %.2f ms max %.2f ms run %.2f ms\n", i ? "SHORT" : "DISPATCH",
+					ps[i].threads, ps[i].jobs, ps[i].stolen, ps[i].dropped, ps[i].depth,
+					ps[i].maxdepth, ps[i].avgwait, ps[i].maxwait, ps[i].avgrun);
 		}
-		jsl_log(JSL_DBG_1, "REPLY WINDOW: clients %ld total reply %d max per client %d\n", 
-				reply_window_.size(), totalrep, maxrep);
 		curr_counts_ = counting_;
 	}
 }
@@ -507,34 +743,25 @@ rpcs::dispatch(djob_t *j) {
     rpcs::rpcstate_t stat;
     char *b1;
     int sz1;
+    client_session *s = NULL;
 
     if (h.clt_nonce) {
-        //have i seen this client before?
-        {
-            ScopedLock rwl(&reply_window_m_);
-            // if we don't know about this clt_nonce, create a cleanup object
-            if (reply_window_.find(h.clt_nonce) == reply_window_.end()) {
-                assert(reply_window_[h.clt_nonce].size() == 0); // create
-                jsl_log(JSL_DBG_2,
-                        "rpcs::dispatch: new client %u xid %d chan %d, total clients %d\n",
-                        h.clt_nonce, h.xid, c->channo(), (int) reply_window_.size());
-            }
-        }
+        reap_sessions();
+        s = get_session(h.clt_nonce);
 
         // save the latest good connection to the client
         {
-            ScopedLock rwl(&conss_m_);
-            if (conns_.find(h.clt_nonce) == conns_.end()) {
-                c->incref();
-                conns_[h.clt_nonce] = c;
-            } else if (conns_[h.clt_nonce] != c) {
-                conns_[h.clt_nonce]->decref();
+            ScopedLock sl(&s->m);
+            if (s->conn != c) {
+                if (s->conn) {
+                    s->conn->decref();
+                }
                 c->incref();
-                conns_[h.clt_nonce] = c;
+                s->conn = c;
             }
         }
 
-        stat = checkduplicate_and_update(h.clt_nonce, h.xid, h.xid_rep, &b1, &sz1);
+        stat = checkduplicate_and_update(s, h.xid, h.xid_rep, &b1, &sz1);
     } else {
         //this client does not require at most once logic
         stat = NEW;
@@ -557,24 +784,21 @@ rpcs::dispatch(djob_t *j) {
                     "rpcs::dispatch: sending and saving reply of size %d for rpc %u, proc %x ret %d, clt %u\n",
                     sz1, h.xid, proc, rh.ret, h.clt_nonce);
 
-            if (h.clt_nonce > 0) {
-                //only record replies for clients that require at-most-once logic
-                add_reply(h.clt_nonce, h.xid, b1, sz1);
-            }
-
             // get the latest connection to the client
-            {
-                ScopedLock rwl(&conss_m_);
-                if (c->isdead() && c != conns_[h.clt_nonce]) {
+            if (s != NULL) {
+                ScopedLock sl(&s->m);
+                if (c->isdead() && c != s->conn) {
                     c->decref();
-                    c = conns_[h.clt_nonce];
+                    c = s->conn;
                     c->incref();
                 }
             }
 
+            // send before the reply goes into the window, where it is freed
+            // as soon as the client acknowledges it
             c->send(b1, sz1);
-            if (h.clt_nonce == 0) {
-                //reply is not added to at-most-once window, free it
+            //only record replies for clients that require at-most-once logic
+            if (s == NULL || !add_reply(s, h.xid, b1, sz1)) {
                 free(b1);
             }
             break;
@@ -582,6 +806,7 @@ rpcs::dispatch(djob_t *j) {
             break;
         case DONE: //duplicate and we still have the response
             c->send(b1, sz1);
+            free(b1);
             break;
         case FORGOTTEN: //very old request and we don't have the response anymore
             jsl_log(JSL_DBG_2, "rpcs::dispatch: very old request %u from %u\n",
@@ -591,88 +816,167 @@ rpcs::dispatch(djob_t *j) {
             c->send(rep.cstr(), rep.size());
             break;
     }
+    if (s != NULL) {
+        put_session(s);
+    }
     c->decref();
 }
 
-enum messageStates {
-    M_INPROGRESS, M_DONE
-};
-std::map<unsigned int, std::map<unsigned int, messageStates>> xidState;
-pthread_mutex_t stateLock = PTHREAD_MUTEX_INITIALIZER;
+static time_t
+monotonic_secs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+rpcs::client_session *
+rpcs::get_session(unsigned int clt_nonce) {
+    session_shard &sh = shards_[clt_nonce % session_shards];
+    ScopedLock sl(&sh.m);
+    client_session *&s = sh.sessions[clt_nonce];
+    if (s == NULL) {
+        s = new client_session();
+        jsl_log(JSL_DBG_2, "rpcs::get_session: new client %u\n", clt_nonce);
+    }
+    ScopedLock cl(&s->m);
+    s->active++;
+    s->last = monotonic_secs();
+    return s;
+}
 
 void
-rpcs::add_reply(unsigned int clt_nonce, unsigned int xid,
-                char *b, int sz) {
-    ScopedLock rwl(&reply_window_m_);
-    pthread_mutex_lock(&stateLock);
+rpcs::put_session(client_session *s) {
+    ScopedLock sl(&s->m);
+    s->active--;
+}
 
-    reply_t reply(xid);
-    reply.buf = b;
-    reply.sz = sz;
+void
+rpcs::reap_sessions(void) {
+    time_t now = monotonic_secs();
+    if (pthread_mutex_trylock(&reap_m_) != 0) {
+        return;
+    }
+    if (now - last_reap_ < session_reap_interval) {
+        assert(pthread_mutex_unlock(&reap_m_) == 0);
+        return;
+    }
+    last_reap_ = now;
+
+    unsigned int reaped = 0;
+    for (unsigned int i = 0; i < session_shards; i++) {
+        ScopedLock sl(&shards_[i].m);
+        std::unordered_map<unsigned int, client_session *> &sessions = shards_[i].sessions;
+        for (auto it = sessions.begin(); it != sessions.end();) {
+            client_session *s = it->second;
+            bool idle;
+            {
+                ScopedLock cl(&s->m);
+                idle = s->active == 0 && now - s->last > session_timeout;
+            }
+            if (!idle) {
+                it++;
+                continue;
+            }
+            // get_session needs the shard lock, so nobody finds s any more
+            for (auto &rep : s->replies) {
+                free(rep.second.buf);
+            }
+            if (s->conn) {
+                s->conn->decref();
+            }
+            delete s;
+            it = sessions.erase(it);
+            reaped++;
+        }
+    }
+    assert(pthread_mutex_unlock(&reap_m_) == 0);
+    if (reaped > 0) {
+        jsl_log(JSL_DBG_2, "rpcs::reap_sessions: dropped %u idle clients\n", reaped);
+    }
+}
 
-    reply_window_[clt_nonce].push_back(reply);
-    xidState[clt_nonce][xid] = M_DONE;
+bool
+rpcs::add_reply(client_session *s, unsigned int xid,
+                char *b, int sz) {
+    ScopedLock sl(&s->m);
 
-    pthread_mutex_unlock(&stateLock);
+    std::unordered_map<unsigned int, reply_t>::iterator it = s->replies.find(xid);
+    if (it == s->replies.end()) {
+        return false;
+    }
+    it->second.buf = b;
+    it->second.sz = sz;
+    return true;
 }
 
 void
-rpcs::free_reply_window(void) {
-    std::map < unsigned
-    int, std::list < reply_t > > ::iterator
-    clt;
-    std::list<reply_t>::iterator it;
-
-    ScopedLock rwl(&reply_window_m_);
-    for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++) {
-        for (it = clt->second.begin(); it != clt->second.end(); it++) {
-            free((*it).buf);
+rpcs::free_sessions(void) {
+    std::unordered_map<unsigned int, reply_t>::iterator it;
+
+    for (unsigned int i = 0; i < session_shards; i++) {
+        ScopedLock sl(&shards_[i].m);
+        for (auto &clt : shards_[i].sessions) {
+            client_session *s = clt.second;
+            for (it = s->replies.begin(); it != s->replies.end(); it++) {
+                free(it->second.buf);
+            }
+            if (s->conn) {
+                s->conn->decref();
+            }
+            delete s;
         }
-        clt->second.clear();
+        shards_[i].sessions.clear();
     }
-    reply_window_.clear();
 }
 
+// a DONE reply is a copy, for the caller to free: the window may drop the
+// original as soon as the lock is released
 rpcs::rpcstate_t
-rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
+rpcs::checkduplicate_and_update(client_session *s, unsigned int xid,
                                 unsigned int xid_rep, char **b, int *sz) {
-    ScopedLock rwl(&reply_window_m_);
-    pthread_mutex_lock(&stateLock);
-
-    // make sure window is sorted correctly
-    reply_window_[clt_nonce].sort([](const reply_t &a, const reply_t &b) { return a.xid < b.xid; });
-
-    // Delete unnecessary data
-    auto it = reply_window_[clt_nonce].begin();
-    while (it != reply_window_[clt_nonce].end() && it->xid <= xid_rep) {
-        free(it->buf);
-        reply_window_[clt_nonce].erase(it++);
+    ScopedLock sl(&s->m);
+
+    // drop what the client has acknowledged since, walking either the
+    // newly acknowledged xids or the window, whichever is shorter
+    if (xid_rep > s->xid_rep) {
+        std::unordered_map<unsigned int, reply_t>::iterator it;
+        if (xid_rep - s->xid_rep <= s->replies.size()) {
+            for (unsigned int x = s->xid_rep + 1; x <= xid_rep; x++) {
+                if ((it = s->replies.find(x)) != s->replies.end()) {
+                    free(it->second.buf);
+                    s->replies.erase(it);
+                }
+            }
+        } else {
+            for (it = s->replies.begin(); it != s->replies.end();) {
+                if (it->first <= xid_rep) {
+                    free(it->second.buf);
+                    it = s->replies.erase(it);
+                } else {
+                    it++;
+                }
+            }
+        }
+        s->xid_rep = xid_rep;
     }
 
-    // Check if everything has been deleted as it should
-    assert(reply_window_[clt_nonce].empty() || xid_rep < reply_window_[clt_nonce].front().xid ||
-           xid_rep < reply_window_[clt_nonce].back().xid);
-
+    if (xid <= s->xid_rep) {
+        return FORGOTTEN;
+    }
 
-    if (xidState[clt_nonce].find(xid) != xidState[clt_nonce].end() && xidState[clt_nonce].at(xid) == M_INPROGRESS) {
-        pthread_mutex_unlock(&stateLock);
-        return INPROGRESS;
+    std::unordered_map<unsigned int, reply_t>::iterator it = s->replies.find(xid);
+    if (it == s->replies.end()) {
+        s->replies.insert(std::make_pair(xid, reply_t(xid)));
+        return NEW;
     }
-    if (xidState[clt_nonce].find(xid) != xidState[clt_nonce].end() && xidState[clt_nonce].at(xid) == M_DONE) {
-        // message is somewhere in the interval window. we have seen it already    
-        for (reply_t &result : reply_window_[clt_nonce]) {
-            if (result.xid == xid) {
-                *b = result.buf;
-                *sz = result.sz;
-                pthread_mutex_unlock(&stateLock);
-                return DONE;
-            }
-        }
+    if (it->second.buf == NULL) {
+        return INPROGRESS;
     }
-
-    xidState[clt_nonce][xid] = M_INPROGRESS;
-    pthread_mutex_unlock(&stateLock);
-    return NEW;
+    *sz = it->second.sz;
+    *b = (char *) malloc(*sz);
+    assert(*b);
+    memcpy(*b, it->second.buf, *sz);
+    return DONE;
 }
 
 //rpc handler
@@ -684,26 +988,11 @@ rpcs::rpcbind(int a, int &r) {
 }
 
 void
-marshall::rawbyte(unsigned char x) {
-    if (_ind >= _capa) {
-        _capa *= 2;
-        assert(_buf != NULL);
-        _buf = (char *) realloc(_buf, _capa);
-        assert(_buf);
-    }
-    _buf[_ind++] = x;
-}
-
-void
-marshall::rawbytes(const char *p, int n) {
-    if ((_ind + n) > _capa) {
-        _capa = _capa > n ? 2 * _capa : (_capa + n);
-        assert(_buf != NULL);
-        _buf = (char *) realloc(_buf, _capa);
-        assert(_buf);
-    }
-    memcpy(_buf + _ind, p, n);
-    _ind += n;
+marshall::grow(int n) {
+    _capa = std::max(2 * _capa, _ind + n);
+    assert(_buf != NULL);
+    _buf = (char *) realloc(_buf, _capa);
+    assert(_buf);
 }
 
 marshall &
@@ -721,8 +1010,7 @@ operator<<(marshall &m, char x) {
 
 marshall &
 operator<<(marshall &m, unsigned short x) {
-    m.rawbyte((x >> 8) & 0xff);
-    m.rawbyte(x & 0xff);
+    m.put16(x);
     return m;
 }
 
@@ -735,10 +1023,7 @@ operator<<(marshall &m, short x) {
 marshall &
 operator<<(marshall &m, unsigned int x) {
     //network order is big-endian
-    m.rawbyte((x >> 24) & 0xff);
-    m.rawbyte((x >> 16) & 0xff);
-    m.rawbyte((x >> 8) & 0xff);
-    m.rawbyte(x & 0xff);
+    m.put32(x);
     return m;
 }
 
@@ -750,34 +1035,18 @@ operator<<(marshall &m, int x) {
 
 marshall &
 operator<<(marshall &m, const std::string &s) {
-    m << (unsigned int) s.size();
+    m.reserve(sizeof(uint32_t) + s.size());
+    m.put32(s.size());
     m.rawbytes(s.data(), s.size());
     return m;
 }
 
 marshall &
 operator<<(marshall &m, unsigned long long x) {
-    m << (unsigned int) (x >> 32);
-    m << (unsigned int) x;
+    m.put64(x);
     return m;
 }
 
-void
-marshall::pack(int x) {
-    rawbyte((x >> 24) & 0xff);
-    rawbyte((x >> 16) & 0xff);
-    rawbyte((x >> 8) & 0xff);
-    rawbyte(x & 0xff);
-}
-
-void
-unmarshall::unpack(int *x) {
-    (*x) = (rawbyte() & 0xff) << 24;
-    (*x) |= (rawbyte() & 0xff) << 16;
-    (*x) |= (rawbyte() & 0xff) << 8;
-    (*x) |= rawbyte() & 0xff;
-}
-
 //take the contents from another unmarshall object
 void
 unmarshall::take_in(unmarshall &another) {
@@ -797,16 +1066,6 @@ unmarshall::okdone() {
     }
 }
 
-unsigned int
-unmarshall::rawbyte() {
-    char c = 0;
-    if (_ind >= _sz)
-        _ok = false;
-    else
-        c = _buf[_ind++];
-    return c;
-}
-
 unmarshall &
 operator>>(unmarshall &u, unsigned char &x) {
     x = (unsigned char) u.rawbyte();
@@ -822,42 +1081,31 @@ operator>>(unmarshall &u, char &x) {
 
 unmarshall &
 operator>>(unmarshall &u, unsigned short &x) {
-    x = (u.rawbyte() & 0xff) << 8;
-    x |= u.rawbyte() & 0xff;
+    x = u.get16();
     return u;
 }
 
 unmarshall &
 operator>>(unmarshall &u, short &x) {
-    x = (u.rawbyte() & 0xff) << 8;
-    x |= u.rawbyte() & 0xff;
+    x = u.get16();
     return u;
 }
 
 unmarshall &
 operator>>(unmarshall &u, unsigned int &x) {
-    x = (u.rawbyte() & 0xff) << 24;
-    x |= (u.rawbyte() & 0xff) << 16;
-    x |= (u.rawbyte() & 0xff) << 8;
-    x |= u.rawbyte() & 0xff;
+    x = u.get32();
     return u;
 }
 
 unmarshall &
 operator>>(unmarshall &u, int &x) {
-    x = (u.rawbyte() & 0xff) << 24;
-    x |= (u.rawbyte() & 0xff) << 16;
-    x |= (u.rawbyte() & 0xff) << 8;
-    x |= u.rawbyte() & 0xff;
+    x = u.get32();
     return u;
 }
 
 unmarshall &
 operator>>(unmarshall &u, unsigned long long &x) {
-    unsigned int h, l;
-    u >> h;
-    u >> l;
-    x = l | ((unsigned long long) h << 32);
+    x = u.get64();
     return u;
 }
 
@@ -888,13 +1136,9 @@ operator>>(unmarshall &u, std::string &s) {
 
 void
 unmarshall::rawbytes(std::string &ss, unsigned int n) {
-    if ((_ind + n) > (unsigned) _sz) {
-        _ok = false;
-    } else {
-        std::string tmps = std::string(_buf + _ind, n);
-        swap(ss, tmps);
-        assert(ss.size() == n);
-        _ind += n;
+    const char *p = take(n);
+    if (p != NULL) {
+        ss.assign(p, n);
     }
 }
 
@@ -5,6 +5,8 @@
 #include <netinet/in.h>
 #include <list>
 #include <map>
+#include <unordered_map>
+#include <set>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -28,12 +30,19 @@ public:
     static const int cancel_failure = -7;
 };
 
+class rpc_future;
+
+struct rpc_waitset;
+
 // rpc client endpoint.
 // manages a xid space per destination socket
 // threaded: multiple threads can be sending RPCs,
 class rpcc : public chanmgr {
 
 private:
+    friend class rpc_future;
+
+    friend int when_quorum(std::vector<rpc_future *> &calls, size_t k);
 
     //manages per rpc info
     struct caller {
@@ -47,10 +56,27 @@ private:
         bool done;
         pthread_mutex_t m;
         pthread_cond_t c;
+        rpc_waitset *waitset;   // woken up too when done
     };
 
     void get_refconn(connection **ch);
 
+    // call1 in steps, so that async_call can return between them
+    int start_call(unsigned int proc, marshall &req, caller &ca);
+
+    void transmit(unsigned int proc, marshall &req, caller &ca, connection *&ch);
+
+    void retransmit(unsigned int proc, marshall &req, caller &ca, connection *&ch);
+
+    int finish_call(unsigned int proc, marshall &req, caller &ca, connection *&ch,
+                    struct timespec finaldeadline);
+
+    void end_call(caller &ca, connection *ch);
+
+    void set_waitset(caller &ca, rpc_waitset *ws);
+
+    void start_async(rpc_future *f, int to);
+
     void update_xid_rep(unsigned int xid);
 
 
@@ -143,8 +169,76 @@ public:
              const A4 &a4, const A5 &a5, const A6 &a6, const A7 &a7,
              R &r, TO to = to_max);
 
+    // sends the call and returns without waiting for the reply, which
+    // the returned rpc_future collects. to counts from now
+    template<class... Args>
+    rpc_future *async_call(unsigned int proc, TO to, const Args &... args);
+};
+
+// a call sent by rpcc::async_call. the pollmgr thread takes in the reply;
+// wait blocks for it, retransmitting as rpcc::call would, so one thread
+// can have many calls outstanding and collect them in any order. deleting
+// a future abandons its call. the rpcc must outlive its futures
+class rpc_future {
+    friend class rpcc;
+
+    friend int when_quorum(std::vector<rpc_future *> &calls, size_t k);
+
+    rpcc *cl_;
+    unsigned int proc_;
+    marshall req_;
+    unmarshall rep_;
+    rpcc::caller ca_;
+    connection *ch_;
+    struct timespec deadline_;
+    bool finished_;
+    int ret_;
+
+    rpc_future(rpcc *cl, unsigned int proc);
+
+public:
+    ~rpc_future();
+
+    // the return value of the call, as rpcc::call1 has it
+    int wait();
+
+    // whether wait would return without blocking
+    bool ready();
+
+    // waits and unmarshalls the reply; only once
+    template<class R>
+    int get(R &r);
 };
 
+template<class... Args>
+rpc_future *
+rpcc::async_call(unsigned int proc, TO to, const Args &... args) {
+    rpc_future *f = new rpc_future(this, proc);
+    f->req_.reserve(marshall_size(args...));
+    int unused[] = {0, (f->req_ << args, 0)...};
+    (void) unused;
+    start_async(f, to.to);
+    return f;
+}
+
+template<class R>
+int
+rpc_future::get(R &r) {
+    int intret = wait();
+    if (intret < 0) return intret;
+    rep_ >> r;
+    if (rep_.okdone() != true)
+        return rpc_const::unmarshal_reply_failure;
+    return intret;
+}
+
+// waits for every call; returns the number that got a reply
+int when_all(std::vector<rpc_future *> &calls);
+
+// waits until k of the calls got a reply, or none of the rest can get one
+// in time; returns the number that got a reply. the others stay pending
+int when_quorum(std::vector<rpc_future *> &calls, size_t k);
+
 template<class R>
 int
 rpcc::call_m(unsigned int proc, marshall &req, R &r, TO to) {
@@ -168,6 +262,7 @@ template<class R, class A1>
 int
 rpcc::call(unsigned int proc, const A1 &a1, R &r, TO to) {
     marshall m;
+    m.reserve(marshall_size(a1));
     m << a1;
     return call_m(proc, m, r, to);
 }
@@ -177,6 +272,7 @@ int
 rpcc::call(unsigned int proc, const A1 &a1, const A2 &a2,
            R &r, TO to) {
     marshall m;
+    m.reserve(marshall_size(a1, a2));
     m << a1;
     m << a2;
     return call_m(proc, m, r, to);
@@ -187,6 +283,7 @@ int
 rpcc::call(unsigned int proc, const A1 &a1, const A2 &a2,
            const A3 &a3, R &r, TO to) {
     marshall m;
+    m.reserve(marshall_size(a1, a2, a3));
     m << a1;
     m << a2;
     m << a3;
@@ -198,6 +295,7 @@ int
 rpcc::call(unsigned int proc, const A1 &a1, const A2 &a2,
            const A3 &a3, const A4 &a4, R &r, TO to) {
     marshall m;
+    m.reserve(marshall_size(a1, a2, a3, a4));
     m << a1;
     m << a2;
     m << a3;
@@ -210,6 +308,7 @@ int
 rpcc::call(unsigned int proc, const A1 &a1, const A2 &a2,
            const A3 &a3, const A4 &a4, const A5 &a5, R &r, TO to) {
     marshall m;
+    m.reserve(marshall_size(a1, a2, a3, a4, a5));
     m << a1;
     m << a2;
     m << a3;
@@ -225,6 +324,7 @@ rpcc::call(unsigned int proc, const A1 &a1, const A2 &a2,
            const A3 &a3, const A4 &a4, const A5 &a5,
            const A6 &a6, R &r, TO to) {
     marshall m;
+    m.reserve(marshall_size(a1, a2, a3, a4, a5, a6));
     m << a1;
     m << a2;
     m << a3;
@@ -242,6 +342,7 @@ rpcc::call(unsigned int proc, const A1 &a1, const A2 &a2,
            const A6 &a6, const A7 &a7,
            R &r, TO to) {
     marshall m;
+    m.reserve(marshall_size(a1, a2, a3, a4, a5, a6, a7));
     m << a1;
     m << a2;
     m << a3;
@@ -293,23 +394,66 @@ private:
     int port_;
     unsigned int nonce_;
 
+    // what the server keeps about one client: its latest connection, and
+    // the requests it has not acknowledged a reply for, by xid, with their
+    // replies once done. the client acknowledges every xid up to xid_rep,
+    // so the window only holds those still in flight
+    struct client_session {
+        client_session() : conn(NULL), xid_rep(0), active(0), last(0) {
+            assert(pthread_mutex_init(&m, 0) == 0);
+        }
+
+        ~client_session() {
+            assert(pthread_mutex_destroy(&m) == 0);
+        }
+
+        pthread_mutex_t m;
+        connection *conn;
+        unsigned int xid_rep;
+        std::unordered_map<unsigned int, reply_t> replies;
+        int active;     // dispatches using the session
+        time_t last;    // when the client was last heard from
+    };
+
     // provide at most once semantics by maintaining a window of replies
     // per client that that client hasn't acknowledged receiving yet.
-    std::map<unsigned int, std::list<reply_t> > reply_window_;
+    // sessions are spread over shards with a lock each, so that requests
+    // of different clients do not wait for each other
+    static const unsigned int session_shards = 16;
+
+    struct session_shard {
+        pthread_mutex_t m;
+        std::unordered_map<unsigned int, client_session *> sessions;
+    };
+
+    session_shard shards_[session_shards];
+
+    // a session is dropped once its client has been silent for much longer
+    // than any call is retried; a dead connection alone is not enough, as
+    // the client may reconnect and retransmit. dispatch looks for such
+    // sessions every session_reap_interval seconds
+    static const int session_timeout = 600;
+    static const int session_reap_interval = 60;
+    pthread_mutex_t reap_m_;
+    time_t last_reap_;
+
+    client_session *get_session(unsigned int clt_nonce);
 
-    void free_reply_window(void);
+    void put_session(client_session *s);
 
-    void add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz);
+    void reap_sessions(void);
 
-    rpcstate_t checkduplicate_and_update(unsigned int clt_nonce,
+    void free_sessions(void);
+
+    // false if the client acknowledged xid meanwhile; b is not kept then
+    bool add_reply(client_session *s, unsigned int xid, char *b, int sz);
+
+    rpcstate_t checkduplicate_and_update(client_session *s,
                                          unsigned int xid, unsigned int rep_xid,
                                          char **b, int *sz);
 
     void updatestat(unsigned int proc);
 
-    // latest connection to the client
-    std::map<unsigned int, connection *> conns_;
-
     // counting
     const int counting_;
     int curr_counts_;
@@ -321,10 +465,11 @@ private:
     // map proc # to function
     std::map<int, handler *> procs_;
 
+    // procs whose handlers never block
+    std::set<unsigned int> short_procs_;
+
     pthread_mutex_t procs_m_; // protect insert/delete to procs[]
     pthread_mutex_t count_m_;  //protect modification of counts
-    pthread_mutex_t reply_window_m_; // protect reply window et al
-    pthread_mutex_t conss_m_; // protect conns_
 
 
 protected:
@@ -343,10 +488,13 @@ protected:
     void reg1(unsigned int proc, handler *);
 
     ThrPool *dispatchpool_;
+    ThrPool *shortpool_;    // a lane of its own for the short handlers
     tcpsconn *listener_;
 
 public:
-    rpcs(unsigned int port, int counts = 0);
+    // the dispatch pool starts with threads and grows to maxthreads while
+    // handlers block
+    rpcs(unsigned int port, int counts = 0, int threads = 10, int maxthreads = 100);
 
     ~rpcs();
 
@@ -355,6 +503,13 @@ public:
 
     void set_reachable(bool r) { reachable_ = r; }
 
+    // proc answers right away and never waits for locks held across RPCs,
+    // so it runs on threads of its own, never behind blocked handlers
+    void set_short(unsigned int proc);
+
+    // of the dispatch pool and of the short lane
+    void pool_stats(ThrPool::stats_t &dispatch, ThrPool::stats_t &fast);
+
     bool got_pdu(connection *c, char *b, int sz);
 
     // register a handler
@@ -14,6 +14,7 @@
 #include <string>
 
 #include "rpc.h"
+#include "slock.h"
 
 #include "jsl_log.h"
 #include "gettime.h"
@@ -43,6 +44,10 @@ public:
     int handle_slow(const int a, int &r);
 
     int handle_bigrep(const int a, std::string &r);
+
+    int handle_block(const int a, int &r);
+
+    int handle_unblock(const int a, int &r);
 };
 
 
@@ -121,6 +126,33 @@ srv::handle_bigrep(const int len, std::string &r) {
     return 0;
 }
 
+// handle_block waits until handle_unblock opens the gate
+static pthread_mutex_t gate_m = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_c = PTHREAD_COND_INITIALIZER;
+static bool gate_open = false;
+static int gate_waiting = 0;
+
+int
+srv::handle_block(const int a, int &r) {
+    ScopedLock gl(&gate_m);
+    gate_waiting++;
+    pthread_cond_broadcast(&gate_c);
+    while (!gate_open) {
+        pthread_cond_wait(&gate_c, &gate_m);
+    }
+    r = a;
+    return 0;
+}
+
+int
+srv::handle_unblock(const int a, int &r) {
+    ScopedLock gl(&gate_m);
+    gate_open = true;
+    pthread_cond_broadcast(&gate_c);
+    r = a;
+    return 0;
+}
+
 srv service;
 
 void startserver() {
@@ -129,6 +161,8 @@ void startserver() {
     server->reg(23, &service, &srv::handle_fast);
     server->reg(24, &service, &srv::handle_slow);
     server->reg(25, &service, &srv::handle_bigrep);
+    server->reg(26, &service, &srv::handle_block);
+    server->reg(27, &service, &srv::handle_unblock);
 }
 
 void
@@ -163,6 +197,123 @@ testmarshall() {
     assert(i1 == i && l1 == l && s1 == s);
 }
 
+static double
+seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// marshalls and unmarshalls n requests like the ones of the lab protocols,
+// a few integers and a string of len bytes, timing each direction
+static void
+bench_marshall(const char *what, int len, int n) {
+    std::string s(len, 'x');
+    int bytes = 0;
+
+    double t = seconds();
+    for (int i = 0; i < n; i++) {
+        marshall m;
+        req_header rh(i, 7, 3, 4, 5);
+        m << 12345;
+        m << 1223344455ULL;
+        m << (unsigned short) 80;
+        m << s;
+        m.pack_req_header(rh);
+        bytes = m.size();
+    }
+    double marshalling = seconds() - t;
+
+    marshall m;
+    m << 12345;
+    m << 1223344455ULL;
+    m << (unsigned short) 80;
+    m << s;
+    char *b;
+    int sz;
+    m.take_buf(&b, &sz);
+
+    t = seconds();
+    for (int i = 0; i < n; i++) {
+        unmarshall un(b, sz);
+        req_header rh;
+        int i1;
+        unsigned long long l1;
+        unsigned short s1;
+        std::string str;
+        un.unpack_req_header(&rh);
+        un >> i1;
+        un >> l1;
+        un >> s1;
+        un >> str;
+        assert(un.okdone() && str.size() == (size_t) len);
+        un.take_buf(&b, &sz);
+    }
+    double unmarshalling = seconds() - t;
+    free(b);
+
+    printf("   -- %-5s %8d bytes  marshall %9.1f MB/s %10.0f calls/s  unmarshall %9.1f MB/s %10.0f calls/s\n",
+           what, bytes, (double) bytes * n / marshalling / 1e6, n / marshalling,
+           (double) bytes * n / unmarshalling / 1e6, n / unmarshalling);
+}
+
+void
+marshall_bench() {
+    printf("marshall_bench\n");
+    bench_marshall("small", 16, 2000000);
+    bench_marshall("page", 8192, 200000);
+    bench_marshall("large", 1 << 20, 500);
+    printf("marshall_bench OK\n");
+}
+
+struct bench_client {
+    rpcc *c;
+    int calls;
+};
+
+static void *
+bench_caller(void *xx) {
+    bench_client *b = (bench_client *) xx;
+    for (int i = 0; i < b->calls; i++) {
+        int r;
+        assert(b->c->call(23, i, r) == 0 && r == i + 1);
+    }
+    return 0;
+}
+
+// the calls/s of one server as more and more clients call it at once.
+// each client has an rpcc of its own, and so its own state on the server
+void
+contention_bench() {
+    printf("contention_bench\n");
+    const int total = 64000;
+    const int most = 32;
+    std::vector<bench_client> b(most);
+    std::vector<pthread_t> th(most);
+    for (int i = 0; i < most; i++) {
+        b[i].c = new rpcc(dst);
+        assert(b[i].c->bind() == 0);
+    }
+
+    for (int n = 1; n <= most; n *= 2) {
+        double t = seconds();
+        for (int i = 0; i < n; i++) {
+            b[i].calls = total / n;
+            assert(pthread_create(&th[i], &attr, bench_caller, (void *) &b[i]) == 0);
+        }
+        for (int i = 0; i < n; i++) {
+            pthread_join(th[i], NULL);
+        }
+        t = seconds() - t;
+        printf("   -- %3d clients %10.0f calls/s\n", n, total / t);
+    }
+
+    for (int i = 0; i < most; i++) {
+        delete b[i].c;
+    }
+    printf("contention_bench OK\n");
+}
+
 void *
 client1(void *xx) {
 
@@ -339,6 +490,83 @@ simple_tests(rpcc *c) {
     printf("simple_tests OK\n");
 }
 
+void
+async_test(rpcc *c) {
+    printf("async_test\n");
+    // many calls out at once, collected in any order
+    std::vector<rpc_future *> calls;
+    for (int i = 0; i < 20; i++) {
+        calls.push_back(c->async_call(24, rpcc::to_max, i));
+    }
+    assert(when_all(calls) == 20);
+    for (int i = 19; i >= 0; i--) {
+        int r;
+        assert(calls[i]->ready());
+        assert(calls[i]->get(r) == 0 && r == i + 2);
+        delete calls[i];
+    }
+    printf("   -- when_all .. ok\n");
+
+    // the fast replies make the quorum; the slow ones can be dropped
+    calls.clear();
+    for (int i = 0; i < 6; i++) {
+        calls.push_back(clients[i % NUM_CL]->async_call(i < 3 ? 23 : 24, rpcc::to_max, i));
+    }
+    assert(when_quorum(calls, 3) >= 3);
+    int r;
+    assert(calls[0]->get(r) == 0 && r == 1);
+    for (rpc_future *f : calls) {
+        delete f;
+    }
+    printf("   -- when_quorum .. ok\n");
+
+    // too few arguments fail the same as for call
+    rpc_future *f = c->async_call(22, rpcc::to_max, std::string("just one"));
+    std::string rep;
+    assert(f->get(rep) < 0);
+    delete f;
+    printf("   -- failed call .. ok\n");
+    printf("async_test OK\n");
+}
+
+void *
+blocked_caller(void *xx) {
+    int r;
+    assert(clients[0]->call(26, 7, r) == 0 && r == 7);
+    return 0;
+}
+
+// more handlers block than the pool starts threads with; the one that
+// lets them all go must still get a thread
+void
+blocking_test() {
+    printf("start blocking_test ... ");
+    const int nt = 20;
+    pthread_t th[nt];
+    for (int i = 0; i < nt; i++) {
+        assert(pthread_create(&th[i], &attr, blocked_caller, (void *) 0) == 0);
+    }
+
+    // every blocked handler holds a thread of its own, and idle extra
+    // threads retire, so the pool is looked at while they all wait
+    {
+        ScopedLock gl(&gate_m);
+        while (gate_waiting < nt) {
+            pthread_cond_wait(&gate_c, &gate_m);
+        }
+    }
+    ThrPool::stats_t dispatch, fast;
+    server->pool_stats(dispatch, fast);
+    assert(dispatch.threads >= nt && fast.jobs > 0);
+
+    int r;
+    assert(clients[1]->call(27, 1, r) == 0);
+    for (int i = 0; i < nt; i++) {
+        assert(pthread_join(th[i], NULL) == 0);
+    }
+    printf("OK\n");
+}
+
 void
 concurrent_test(int nt) {
     // create threads that make lots of calls in parallel,
@@ -490,12 +718,14 @@ main(int argc, char *argv[]) {
 
     bool isclient = false;
     bool isserver = false;
+    bool bench = false;
+    bool contention = false;
 
     srandom(getpid());
     port = 20000 + (getpid() % 10000);
 
     char ch = 0;
-    while ((ch = getopt(argc, argv, "csd:p:l")) != -1) {
+    while ((ch = getopt(argc, argv, "csd:p:lmb")) != -1) {
         switch (ch) {
             case 'c':
                 isclient = true;
@@ -509,6 +739,12 @@ main(int argc, char *argv[]) {
             case 'p':
                 port = atoi(optarg);
                 break;
+            case 'm':
+                bench = true;
+                break;
+            case 'b':
+                contention = true;
+                break;
             case 'l':
                 assert(setenv("RPC_LOSSY", "5", 1) == 0);
             default:
@@ -527,6 +763,10 @@ main(int argc, char *argv[]) {
     }
 
     testmarshall();
+    if (bench) {
+        marshall_bench();
+        return 0;
+    }
 
     pthread_attr_init(&attr);
     // set stack size to 32K, so we don't run out of memory
@@ -554,8 +794,17 @@ main(int argc, char *argv[]) {
             assert(clients[i]->bind() == 0);
         }
 
+        if (contention) {
+            contention_bench();
+            exit(0);
+        }
+
         simple_tests(clients[0]);
+        async_test(clients[0]);
         concurrent_test(10);
+        if (isserver) {
+            blocking_test();
+        }
         lossy_test();
         if (isserver) {
             failure_test();
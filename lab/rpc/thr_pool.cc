@@ -1,63 +1,232 @@
 #include "slock.h"
 #include "thr_pool.h"
+#include <assert.h>
 #include <stdlib.h>
 #include <errno.h>
 
+struct worker_arg {
+    ThrPool *tp;
+    int me;
+};
+
 static void *
 do_worker(void *arg) {
-    ThrPool *tp = (ThrPool *) arg;
-    while (1) {
-        ThrPool::job_t j;
-        if (!tp->takeJob(&j))
-            break; //die
+    worker_arg *w = (worker_arg *) arg;
+    ThrPool *tp = w->tp;
+    int me = w->me;
+    delete w;
 
-        (void) (j.f)(j.a);
-    }
+    tp->worker(me);
     pthread_exit(NULL);
 }
 
-//if blocking, then addJob() blocks when queue is full
-//otherwise, addJob() simply returns false when queue is full
-ThrPool::ThrPool(int sz, bool blocking)
-        : nthreads_(sz), blockadd_(blocking), jobq_(100 * sz) {
+static unsigned long long
+usecs_since(const struct timespec &start, struct timespec *now) {
+    clock_gettime(CLOCK_MONOTONIC, now);
+    return (now->tv_sec - start.tv_sec) * 1000000ULL + now->tv_nsec / 1000 - start.tv_nsec / 1000;
+}
+
+static void
+raise_to(std::atomic<unsigned long long> &max, unsigned long long v) {
+    unsigned long long cur = max;
+    while (v > cur && !max.compare_exchange_weak(cur, v));
+}
+
+ThrPool::ThrPool(int sz, bool blocking, int maxsz)
+        : minthreads_(sz), maxthreads_(maxsz > sz ? maxsz : sz), blockadd_(blocking),
+          limit_(100 * (maxsz > sz ? maxsz : sz)), next_(0), pending_(0), idle_(0), adders_(0),
+          threads_(0), stop_(false), live_(0), jobs_(0), stolen_(0), dropped_(0), waitus_(0),
+          runus_(0), maxwaitus_(0), maxdepth_(0) {
     pthread_attr_init(&attr_);
     pthread_attr_setstacksize(&attr_, 128 << 10);
+    pthread_attr_setdetachstate(&attr_, PTHREAD_CREATE_DETACHED);
+    assert(pthread_mutex_init(&m_, 0) == 0);
+    assert(pthread_cond_init(&work_c_, 0) == 0);
+    assert(pthread_cond_init(&space_c_, 0) == 0);
+    assert(pthread_cond_init(&exit_c_, 0) == 0);
+
+    for (int i = 0; i < maxthreads_; i++) {
+        worker_q *q = new worker_q();
+        assert(pthread_mutex_init(&q->m, 0) == 0);
+        q->n = 0;
+        qs_.push_back(q);
+    }
 
     for (int i = 0; i < sz; i++) {
-        pthread_t t;
-        assert(pthread_create(&t, &attr_, do_worker, (void *) this) == 0);
-        th_.push_back(t);
+        spawn();
     }
 }
 
-//IMPORTANT: this function can be called only when no external thread 
-//will ever use this thread pool again or is currently blocking on it
+//IMPORTANT: this function can be called only when no external thread
+//will ever use this thread pool again or is currently blocking on it.
+//the jobs queued by then still run
 ThrPool::~ThrPool() {
-    for (int i = 0; i < nthreads_; i++) {
-        job_t j;
-        j.f = (void *(*)(void *)) NULL; //poison pill to tell worker threads to exit
-        jobq_.enq(j);
+    {
+        ScopedLock ml(&m_);
+        stop_ = true;
+        assert(pthread_cond_broadcast(&work_c_) == 0);
+        while (live_ > 0) {
+            assert(pthread_cond_wait(&exit_c_, &m_) == 0);
+        }
     }
 
-    for (int i = 0; i < nthreads_; i++) {
-        assert(pthread_join(th_[i], NULL) == 0);
+    for (worker_q *q : qs_) {
+        assert(pthread_mutex_destroy(&q->m) == 0);
+        delete q;
     }
-
+    assert(pthread_mutex_destroy(&m_) == 0);
+    assert(pthread_cond_destroy(&work_c_) == 0);
+    assert(pthread_cond_destroy(&space_c_) == 0);
+    assert(pthread_cond_destroy(&exit_c_) == 0);
     assert(pthread_attr_destroy(&attr_) == 0);
 }
 
+void
+ThrPool::spawn() {
+    ScopedLock ml(&m_);
+    if (stop_ || threads_ >= maxthreads_) {
+        return;
+    }
+    worker_arg *w = new worker_arg;
+    w->tp = this;
+    w->me = threads_;
+    pthread_t t;
+    assert(pthread_create(&t, &attr_, do_worker, (void *) w) == 0);
+    threads_++;
+    live_++;
+}
+
 bool
 ThrPool::addJob(void *(*f)(void *), void *a) {
+    if (pending_ >= limit_) {
+        if (!blockadd_) {
+            dropped_++;
+            return false;
+        }
+        ScopedLock ml(&m_);
+        adders_++;
+        while (pending_ >= limit_) {
+            assert(pthread_cond_wait(&space_c_, &m_) == 0);
+        }
+        adders_--;
+    }
+
     job_t j;
     j.f = f;
     j.a = a;
+    clock_gettime(CLOCK_MONOTONIC, &j.queued);
 
-    return jobq_.enq(j, blockadd_);
+    worker_q *q = qs_[next_++ % threads_];
+    {
+        ScopedLock ql(&q->m);
+        q->q.push_back(j);
+        q->n++;
+    }
+
+    int depth = ++pending_;
+    int cur = maxdepth_;
+    while (depth > cur && !maxdepth_.compare_exchange_weak(cur, depth));
+
+    if (idle_ > 0) {
+        ScopedLock ml(&m_);
+        assert(pthread_cond_signal(&work_c_) == 0);
+    }
+    // more jobs wait than there are idle workers to take them; the others
+    // are busy, maybe blocked
+    if (depth > idle_ && threads_ < maxthreads_) {
+        spawn();
+    }
+    return true;
 }
 
+// the oldest job of our own deque, or else the newest of another one
 bool
-ThrPool::takeJob(job_t *j) {
-    jobq_.deq(j);
-    return (j->f != NULL);
+ThrPool::takeJob(int me, job_t *j) {
+    bool found = false;
+    for (int i = 0; i < maxthreads_ && !found; i++) {
+        worker_q *q = qs_[(me + i) % maxthreads_];
+        if (q->n == 0) {
+            continue;
+        }
+        ScopedLock ql(&q->m);
+        if (q->q.empty()) {
+            continue;
+        }
+        if (i == 0) {
+            *j = q->q.front();
+            q->q.pop_front();
+        } else {
+            *j = q->q.back();
+            q->q.pop_back();
+            stolen_++;
+        }
+        q->n--;
+        found = true;
+    }
+    if (!found) {
+        return false;
+    }
+
+    pending_--;
+    if (adders_ > 0) {
+        ScopedLock ml(&m_);
+        assert(pthread_cond_signal(&space_c_) == 0);
+    }
+    return true;
 }
 
+void
+ThrPool::worker(int me) {
+    while (1) {
+        job_t j;
+        if (takeJob(me, &j)) {
+            struct timespec started, done;
+            unsigned long long waited = usecs_since(j.queued, &started);
+            (void) (j.f)(j.a);
+            runus_ += usecs_since(started, &done);
+            waitus_ += waited;
+            raise_to(maxwaitus_, waited);
+            jobs_++;
+            continue;
+        }
+
+        ScopedLock ml(&m_);
+        idle_++;
+        bool leave = false;
+        while (pending_ == 0 && !stop_) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            // only the last of the extra threads leaves, which keeps the
+            // indexes of the others below threads_
+            if (pthread_cond_timedwait(&work_c_, &m_, &deadline) == ETIMEDOUT &&
+                me >= minthreads_ && me == threads_ - 1 && pending_ == 0) {
+                leave = true;
+                break;
+            }
+        }
+        idle_--;
+
+        if (leave || (stop_ && pending_ == 0)) {
+            if (leave) {
+                threads_--;
+            }
+            live_--;
+            assert(pthread_cond_signal(&exit_c_) == 0);
+            return;
+        }
+    }
+}
+
+void
+ThrPool::stats(stats_t &s) {
+    s.jobs = jobs_;
+    s.stolen = stolen_;
+    s.dropped = dropped_;
+    s.threads = threads_;
+    s.depth = pending_;
+    s.maxdepth = maxdepth_;
+    s.avgwait = s.jobs ? waitus_ / 1000.0 / s.jobs : 0;
+    s.maxwait = maxwaitus_ / 1000.0;
+    s.avgrun = s.jobs ? runus_ / 1000.0 / s.jobs : 0;
+}
@@ -2,10 +2,19 @@
 #define __THR_POOL__
 
 #include <pthread.h>
+#include <time.h>
 #include <vector>
-
-#include "fifo.h"
-
+#include <deque>
+#include <atomic>
+
+// a pool of worker threads. every worker has a deque of its own, and
+// jobs are spread over them round-robin. a worker runs the oldest job of
+// its own deque and, once that is empty, steals the newest one of
+// another, so jobs do not wait behind one slow worker and the workers
+// rarely meet on a lock. when a job comes in while no worker is idle,
+// the pool starts another thread, up to maxsz; the extra threads leave
+// again after idling for a second. handlers that block thus do not hold
+// up the jobs queued behind them
 class ThrPool {
 
 
@@ -13,29 +22,75 @@ public:
     struct job_t {
         void *(*f)(void *); //function point
         void *a; //function arguments
+        struct timespec queued;
     };
 
-    ThrPool(int sz, bool blocking = true);
+    struct stats_t {
+        unsigned long long jobs;    // run so far
+        unsigned long long stolen;  // of those, taken from another deque
+        unsigned long long dropped; // refused while the pool was full
+        int threads;
+        int depth;                  // jobs waiting now
+        int maxdepth;
+        double avgwait;             // ms from addJob until a worker took it
+        double maxwait;
+        double avgrun;              // ms a job ran
+    };
+
+    // starts sz threads and grows to maxsz of them; maxsz 0 keeps sz.
+    //if blocking, then addJob() blocks when queue is full
+    //otherwise, addJob() simply returns false when queue is full
+    ThrPool(int sz, bool blocking = true, int maxsz = 0);
 
     ~ThrPool();
 
     template<class C, class A>
     bool addObjJob(C *o, void (C::*m)(A), A a);
 
-    void waitDone();
+    void stats(stats_t &s);
 
-    bool takeJob(job_t *j);
+    void worker(int me);
 
 private:
+    struct worker_q {
+        pthread_mutex_t m;
+        std::deque<job_t> q;
+        std::atomic<int> n;     // q.size(), for looking without the lock
+    };
+
     pthread_attr_t attr_;
-    int nthreads_;
+    int minthreads_;
+    int maxthreads_;
     bool blockadd_;
+    int limit_;                 // jobs queued at most
+
+    std::vector<worker_q *> qs_;    // one per possible thread
+    std::atomic<unsigned int> next_;
+
+    // a worker going to sleep counts itself idle before it looks at
+    // pending_ once more, and addJob counts the job pending before it
+    // looks at idle_, so one of the two always sees the other
+    std::atomic<int> pending_;
+    std::atomic<int> idle_;
+    std::atomic<int> adders_;   // blocked in addJob for space
+    std::atomic<int> threads_;  // they have the indexes [0, threads_)
+
+    pthread_mutex_t m_;
+    pthread_cond_t work_c_;
+    pthread_cond_t space_c_;
+    pthread_cond_t exit_c_;
+    bool stop_;
+    int live_;
+
+    std::atomic<unsigned long long> jobs_, stolen_, dropped_;
+    std::atomic<unsigned long long> waitus_, runus_, maxwaitus_;
+    std::atomic<int> maxdepth_;
 
+    bool addJob(void *(*f)(void *), void *a);
 
-    fifo<job_t> jobq_;
-    std::vector <pthread_t> th_;
+    void spawn();
 
-    bool addJob(void *(*f)(void *), void *a);
+    bool takeJob(int me, job_t *j);
 };
 
 template<class C, class A>
@@ -65,9 +120,12 @@ ThrPool::addObjJob(C *o, void (C::*m)(A), A a) {
     x->o = o;
     x->m = m;
     x->a = a;
-    return addJob(&objfunc_wrapper::func, (void *) x);
+    if (!addJob(&objfunc_wrapper::func, (void *) x)) {
+        delete x;
+        return false;
+    }
+    return true;
 }
 
 
 #endif
-
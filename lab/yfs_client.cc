@@ -11,6 +11,7 @@
 #include "lock_client.h"
 #include <thread>
 #include <chrono>
+#include <algorithm>
 #include "lock_client_cache.h"
 
 
@@ -18,14 +19,20 @@ void
 lock_release_user_implementation::dorelease(lock_protocol::lockid_t lid) {
     int ret;
     while ((ret = ec->flush(lid)) != extent_protocol::OK);
+    yfs->forgetReadahead(lid);
+    if (next != NULL) {
+        next->dorelease(lid);
+    }
 }
 
-yfs_client::yfs_client(std::string extent_dst, std::string lock_dst) {
-    ec = new extent_client(extent_dst);
-    lock_release_user_implementation *impl = new lock_release_user_implementation(ec);
+yfs_client::yfs_client(std::string extent_dst, std::string lock_dst, size_t cacheBytes, lock_release_user *lu) {
+    ec = new extent_client(extent_dst, cacheBytes);
+    pthread_mutex_init(&readaheadLock, NULL);
+    pthread_mutex_init(&inumLock, NULL);
+    nextInum = leaseEnd = 0;
+    lock_release_user_implementation *impl = new lock_release_user_implementation(this, ec, lu);
     lc = new lock_client_cache(lock_dst, impl);
-
-    srand(getpid());
+    locks = new owned_locks(lc);
 
     // make root available at startup
     inum root = 1;
@@ -69,7 +76,7 @@ yfs_client::filename(inum inum) {
 
 bool
 yfs_client::isfile(inum inum) {
-    return (inum & 0x80000000);
+    return (inum & file_bit) != 0;
 }
 
 bool
@@ -77,52 +84,6 @@ yfs_client::isdir(inum inum) {
     return !isfile(inum);
 }
 
-// http://stackoverflow.com/questions/14265581/parse-split-a-string-in-c-using-string-delimiter-standard-c
-vector <string>
-split(string s, string delimiter) {
-    size_t pos = 0;
-    vector <string> output;
-    string token;
-
-    while ((pos = s.find(delimiter)) != std::string::npos) {
-        token = s.substr(0, pos);
-        output.push_back(token);
-        s.erase(0, pos + delimiter.length());
-    }
-
-    output.push_back(s);
-    return output;
-}
-
-std::string
-yfs_client::serializeDirectoryEntries(std::map <std::string, yfs_client::inum> directory) {
-    string result = "";
-
-    for (auto const &iterator : directory) {
-        string name = iterator.first;
-        inum inum = iterator.second;
-        result += name + string(";") + filename(inum) + string("\n");
-    }
-
-    return result;
-}
-
-std::map <std::string, yfs_client::inum>
-yfs_client::unserializeDirectoryEntries(std::string serializedDirectory) {
-    map <std::string, yfs_client::inum> directories;
-
-    for (const string &row : split(serializedDirectory, "\n")) {
-        if (!row.empty()) {
-            vector <string> entry = split(row, ";");
-            string name = entry.at(0);
-            inum inum = n2i(entry.at(1));
-            directories[name] = inum;
-        }
-    }
-
-    return directories;
-}
-
 int
 yfs_client::getfile(inum inum, fileinfo &fin) {
     int ret = IOERR;
@@ -174,80 +135,67 @@ yfs_client::unlink(inum parent, std::string unlinkedItem) {
 
     lock(parent);
 
-    std::string data;
-
-    if ((ret = ec->get(parent, data)) == extent_protocol::OK) {
-        auto dirData = unserializeDirectoryEntries(data);
-
-        auto e = dirData.find(unlinkedItem);
-
-        if (e != dirData.end() && !isdir(e->second)) {
-            fileInum = e->second;
-            dirData.erase(e);
-
-            ret = ec->put(parent, serializeDirectoryEntries(dirData));
-
-            if (ret == extent_protocol::OK) {
-                lock(fileInum);
-                ec->remove(fileInum);
-                unlock(fileInum);
-            }
+    if (ec->dir_lookup(parent, unlinkedItem, fileInum) == extent_protocol::OK && !isdir(fileInum)) {
+        // the entry and the file go in one compound call
+        std::vector<extent_protocol::compound_op> ops(2);
+        ops[0].type = extent_protocol::compound_op::DIR_REMOVE;
+        ops[0].id = parent;
+        ops[0].name = unlinkedItem;
+        ops[1].type = extent_protocol::compound_op::REMOVE;
+        ops[1].id = fileInum;
+
+        lock(fileInum);
+        if (ec->compound(ops) == extent_protocol::OK) {
+            ret = OK;
+            forgetReadahead(fileInum);
+        } else {
+            ret = IOERR;
         }
+        unlock(fileInum);
     }
 
     unlock(parent);
     return ret;
 }
 
+// the new extent and its directory entry go to the server in one compound
+// call, which fails with EXIST if the name is taken
 int
 yfs_client::createNode(inum parent, std::string name, inum &newInum, bool isDirectory) {
     lock(parent);
     int ret;
 
-    std::string serializedDirectory;
+    inum existing;
 
     if (!isdir(parent)) {
         ret = NOENT;
-    } else if ((ret = ec->get(parent, serializedDirectory)) == extent_protocol::OK) {
-        auto directory = unserializeDirectoryEntries(serializedDirectory);
-
-        if (directory.find(name) == directory.end()) {
-            // file doesn't exist yet. everything is ok.
-            // continue by creating a new file
-            // create new inum first.
-
-            newInum = std::rand();
-
-            if (isDirectory) {
-                newInum &= 0x7FFFFFFF;
-            } else {
-                newInum |= 0x80000000;
-            }
-
-            lock(newInum);
-
-            // create the file itself
-            if (ec->put(newInum, string("")) != extent_protocol::OK) {
-                ret = IOERR;
-            } else {
-                // add "file" to directory and update it
-                directory[name] = newInum;
-
-                // update directory
-                if (ec->put(parent, serializeDirectoryEntries(directory)) != extent_protocol::OK) {
-                    ret = IOERR;
-                } else {
-                    ret = OK;
-                }
-            }
-            unlock(newInum);
+    } else if (allocInum(isDirectory, newInum) != OK) {
+        ret = IOERR;
+    } else {
+        // the extent before the entry that points at it
+        std::vector<extent_protocol::compound_op> ops(2);
+        ops[0].type = extent_protocol::compound_op::PUT;
+        ops[0].id = newInum;
+        ops[1].type = extent_protocol::compound_op::DIR_ADD;
+        ops[1].id = parent;
+        ops[1].name = name;
+        ops[1].inum = newInum;
+
+        lock(newInum);
+        ret = ec->compound(ops);
+        unlock(newInum);
+
+        if (ret == extent_protocol::OK) {
+            ret = OK;
+        } else if (ret != extent_protocol::EXIST) {
+            ret = IOERR;
+        } else if (ec->dir_lookup(parent, name, existing) != extent_protocol::OK) {
+            ret = IOERR;
+        } else if (isDirectory) {
+            ret = EXISTING;
         } else {
-            if (isDirectory) {
-                ret = EXISTING;
-            } else {
-                newInum = directory[name];
-                ret = OK;
-            }
+            newInum = existing;
+            ret = OK;
         }
     }
 
@@ -255,22 +203,36 @@ yfs_client::createNode(inum parent, std::string name, inum &newInum, bool isDire
     return ret;
 }
 
+// numbers come from the current lease, and only a used up lease costs a
+// round trip to the extent server
+int
+yfs_client::allocInum(bool isDirectory, inum &i) {
+    pthread_mutex_lock(&inumLock);
+    if (nextInum == leaseEnd) {
+        unsigned long long first;
+        if (ec->alloc(inum_lease, first) != extent_protocol::OK) {
+            pthread_mutex_unlock(&inumLock);
+            return IOERR;
+        }
+        nextInum = first;
+        leaseEnd = first + inum_lease;
+    }
+    i = nextInum++;
+    pthread_mutex_unlock(&inumLock);
+
+    if (!isDirectory) {
+        i |= file_bit;
+    }
+    return OK;
+}
+
 int
 yfs_client::lookUp_ino(inum parent, std::string name, inum &i) {
     lock(parent);
     int ret = NOENT;
 
-    // store directory data in string
-    std::string data;
-
-    if (ec->get(parent, data) == extent_protocol::OK) {
-        auto directory = unserializeDirectoryEntries(data);
-        auto e = directory.find(name);
-
-        if (e != directory.end()) {
-            i = e->second;
-            ret = OK;
-        }
+    if (ec->dir_lookup(parent, name, i) == extent_protocol::OK) {
+        ret = OK;
     }
 
     unlock(parent);
@@ -278,73 +240,161 @@ yfs_client::lookUp_ino(inum parent, std::string name, inum &i) {
 }
 
 int
-yfs_client::getDirData(inum dir, std::string &data) {
+yfs_client::readdir(inum dir, unsigned long long cursor, unsigned int count, std::vector<dirent> &entries,
+                    std::vector<unsigned long long> &cursors) {
+    int ret;
+    extent_protocol::dirlist list;
+
     lock(dir);
-    auto ret = ec->get(dir, data);
+    ret = ec->dir_list(dir, cursor, count, list);
     unlock(dir);
 
-    return ret;
+    if (ret != extent_protocol::OK) {
+        return ret == extent_protocol::STALE ? STALE : IOERR;
+    }
+    std::vector<extent_protocol::extentid_t> children;
+    for (auto &d : list.entries) {
+        dirent e;
+        e.name = d.name;
+        e.inum = d.inum;
+        entries.push_back(e);
+        children.push_back(d.inum);
+    }
+    cursors.insert(cursors.end(), list.cursors.begin(), list.cursors.end());
+
+    // a listing is usually followed by a getattr of every entry
+    ec->prefetchAttrs(children, *locks);
+    return OK;
 }
 
-int yfs_client::setSize(inum ino, int size) {
+int yfs_client::setSize(inum ino, off_t size) {
     int ret = NOENT;
-    lock(ino);
-    std::string buf;
-
-    if (ec->get(ino, buf) == extent_protocol::OK) {
-        buf.resize(size);
-        ec->put(ino, buf);
 
-        while (lc->release(ino) != lock_protocol::OK);
+    lock(ino);
+    extent_protocol::status r = ec->truncate(ino, size);
+    if (r == extent_protocol::OK) {
         ret = OK;
+    } else if (r == extent_protocol::FBIG) {
+        ret = FBIG;
     }
-
     unlock(ino);
+
     return ret;
 }
 
 int yfs_client::write(inum ino, off_t off, string &data) {
+    return write(ino, off, data.data(), data.size());
+}
+
+int yfs_client::write(inum ino, off_t off, const char *data, size_t size) {
     int ret = IOERR;
 
     lock(ino);
-    std::string buf;
-
-    if (ec->get(ino, buf) == extent_protocol::OK) {
-        if (((size_t) off) > buf.size()) {
-            buf.resize(off);
-            buf.append(data);
-        } else {
-            buf.replace(off, data.size(), data);
-        }
-
-        ec->put(ino, buf);
-
+    extent_protocol::status r = ec->write(ino, off, data, size);
+    if (r == extent_protocol::OK) {
         ret = OK;
+    } else if (r == extent_protocol::FBIG) {
+        ret = FBIG;
     }
-
     unlock(ino);
+
     return ret;
 }
 
 int yfs_client::read(inum ino, size_t size, off_t off, string &data) {
     int ret = IOERR;
 
+    if (off < 0) {
+        off = 0;
+    }
+
     lock(ino);
-    std::string buf;
-
-    if (ec->get(ino, buf) == extent_protocol::OK) {
-        if (off < 0) {
-            data = buf.substr(0, size);
-        } else if (off + size > buf.size()) {
-            data = buf.substr(off);
-            data.resize(size, '\0');
-        } else {
-            data = buf.substr(off, size);
+    if (ec->read(ino, off, size, data) == extent_protocol::OK) {
+        // reads past the end of the file are padded with zeroes
+        data.resize(size, '\0');
+        ret = OK;
+        readahead(ino, off, size);
+    }
+    unlock(ino);
+
+    return ret;
+}
+
+// the prefetches are issued under the inode's lock; the extent client drops
+// any that only run after the lock is gone
+void yfs_client::readahead(inum ino, off_t off, size_t size) {
+    pthread_mutex_lock(&readaheadLock);
+    auto it = readaheads.find(ino);
+    if (it == readaheads.end()) {
+        // dropping the state of another inode only restarts its window
+        if (readaheads.size() >= readahead_files) {
+            readaheads.erase(readaheads.begin());
         }
+        it = readaheads.insert(std::make_pair(ino, readahead_state())).first;
+    }
+    readahead_state &ra = it->second;
+    unsigned long long end = off + size;
+
+    if ((unsigned long long) off == ra.next) {
+        ra.window = ra.window == 0 ? readahead_min : std::min(ra.window * 2, (unsigned long long) readahead_max);
+    } else {
+        ra.window = 0;
+        ra.ahead = 0;
+    }
+    ra.next = end;
 
-        ret = OK;
+    unsigned long long from = std::max(end, ra.ahead);
+    if (ra.window > 0 && from < end + ra.window) {
+        ec->prefetch(ino, from, end + ra.window - from);
+        ra.ahead = end + ra.window;
+    }
+    pthread_mutex_unlock(&readaheadLock);
+}
+
+void yfs_client::forgetReadahead(inum ino) {
+    pthread_mutex_lock(&readaheadLock);
+    readaheads.erase(ino);
+    pthread_mutex_unlock(&readaheadLock);
+}
+
+// pads a read with zeroes up to the size asked for
+class padded_reader : public extent_reader {
+    extent_reader &next;
+    size_t size;
+
+public:
+    padded_reader(extent_reader &next, size_t size) : next(next), size(size) {}
+
+    void consume(const struct iovec *iov, int count) {
+        static char zeroes[4096];
+        std::vector<struct iovec> v(iov, iov + count);
+        size_t have = 0;
+        for (int i = 0; i < count; i++) {
+            have += iov[i].iov_len;
+        }
+        while (have < size) {
+            struct iovec z = {zeroes, std::min(size - have, sizeof(zeroes))};
+            v.push_back(z);
+            have += z.iov_len;
+        }
+        next.consume(v.data(), v.size());
     }
+};
 
+int yfs_client::read(inum ino, size_t size, off_t off, extent_reader &reader) {
+    int ret = IOERR;
+
+    if (off < 0) {
+        off = 0;
+    }
+
+    padded_reader padded(reader, size);
+    lock(ino);
+    if (ec->read(ino, off, size, padded) == extent_protocol::OK) {
+        ret = OK;
+        readahead(ino, off, size);
+    }
     unlock(ino);
+
     return ret;
 }
@@ -11,25 +11,69 @@
 
 using namespace std;
 
+class yfs_client;
+
 class lock_release_user_implementation : public lock_release_user {
+    yfs_client *yfs;
     extent_client *ec;
+    lock_release_user *next;
 
     void dorelease(lock_protocol::lockid_t);
 
 public:
-    lock_release_user_implementation(extent_client *ec) {
+    // next, if any, is told after the extents are written back
+    lock_release_user_implementation(yfs_client *yfs, extent_client *ec, lock_release_user *next = NULL) {
+        this->yfs = yfs;
         this->ec = ec;
+        this->next = next;
+    }
+};
+
+// the locks this client owns, see extent_client::prefetchAttrs
+class owned_locks : public extent_locks {
+    lock_client_cache *lc;
+
+public:
+    owned_locks(lock_client_cache *lc) : lc(lc) {}
+
+    bool held(extent_protocol::extentid_t eid) {
+        return lc->owned(eid);
     }
 };
 
 class yfs_client {
     extent_client *ec;
-    lock_client *lc;
+    lock_client_cache *lc;
+    owned_locks *locks;
+
+    // reads that go on where the last one of the inode stopped are
+    // sequential; ahead of them the next window is prefetched, twice as
+    // large each time up to readahead_max. any other read starts over, and
+    // so does the first read after the inode's lock came back. the state of
+    // at most readahead_files inodes is kept
+    struct readahead_state {
+        unsigned long long next = 0;     // where a sequential read starts
+        unsigned long long window = 0;   // 0 after a random read
+        unsigned long long ahead = 0;    // prefetched up to here
+    };
+    static const unsigned int readahead_min = 128 << 10;
+    static const unsigned int readahead_max = 2 << 20;
+    static const unsigned int readahead_files = 1024;
+    std::map<unsigned long long, readahead_state> readaheads;
+    pthread_mutex_t readaheadLock;
+
+    // inode numbers leased from the extent server, [nextInum, leaseEnd)
+    static const unsigned int inum_lease = 1024;
+    unsigned long long nextInum;
+    unsigned long long leaseEnd;
+    pthread_mutex_t inumLock;
 public:
 
     typedef unsigned long long inum;
+    // set in the inode numbers of files
+    static const inum file_bit = 1ULL << 63;
     enum xxstatus {
-        OK, RPCERR, NOENT, IOERR, FBIG, EXISTING
+        OK, RPCERR, NOENT, IOERR, FBIG, EXISTING, STALE
     };
     typedef int status;
 
@@ -58,12 +102,18 @@ private:
 
     void unlock(inum inum);
 
-public:
-    static std::string serializeDirectoryEntries(map <std::string, inum>);
+    void readahead(inum ino, off_t off, size_t size);
 
-    static map <std::string, inum> unserializeDirectoryEntries(std::string);
+    void forgetReadahead(inum ino);
 
-    yfs_client(std::string, std::string);
+    friend class lock_release_user_implementation;
+
+    int allocInum(bool isDirectory, inum &i);
+
+public:
+    // lu is told whenever the lock of an inode goes back to the lock server
+    yfs_client(std::string, std::string, size_t cacheBytes = extent_client::default_cache_bytes,
+               lock_release_user *lu = NULL);
 
     bool isfile(inum);
 
@@ -80,14 +130,23 @@ public:
 
     int createNode(inum parent, std::string name, inum &newInum, bool isDirectory);
 
-    int getDirData(inum dir, std::string &data);
+    // up to count entries from cursor on, 0 being the start; cursors[i]
+    // resumes after entries[i]. STALE if the directory was rewritten since
+    // cursor was handed out
+    int readdir(inum dir, unsigned long long cursor, unsigned int count, std::vector<dirent> &entries,
+                std::vector<unsigned long long> &cursors);
 
-    int setSize(inum, int);
+    int setSize(inum, off_t size);
 
     int write(inum, off_t off, std::string &data);
 
+    int write(inum, off_t off, const char *data, size_t size);
+
     int read(inum, size_t size, off_t off, std::string &data);
 
+    // hands reader the data straight from the extent cache
+    int read(inum, size_t size, off_t off, extent_reader &reader);
+
     int unlink(inum parent, std::string unlinkedItem);
 };
 